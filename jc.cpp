@@ -0,0 +1,1166 @@
+#include "jc.h"
+#include "jit_calc.h"
+
+#include <new>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <system_error>
+#include <exception>
+#include <atomic>
+#include <chrono>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+struct jc_job;
+
+// Per-node copies of the code with the constants embedded, for
+// JC_PARALLEL_REPLICATE. Each is compiled by a thread of its node, so its
+// pages are allocated there, the first time that node evaluates.
+struct jc_replicas {
+    std::vector<x86::Function> code;
+    std::unique_ptr<std::once_flag[]> compiled;
+};
+
+struct jc_expr {
+    std::shared_ptr<Node> tree;
+    std::vector<double> values;
+    Function function;
+    x86::Function fObj, fScalars;
+    double (*code)(const double *);
+    float (*codeSingle)(const float *);
+    size_t variables;
+    size_t parameters;
+    size_t literals;
+    size_t tileRows;
+    unsigned flags;
+
+    // Created by the first replicated evaluation and dropped whenever the
+    // constants change, since the copies embed them.
+    mutable std::shared_ptr<jc_replicas> replicas;
+    mutable std::mutex replicasMutex;
+};
+
+struct jc_job {
+    const jc_expr *e;
+    std::vector<const void *> columns;
+    void *out;
+    size_t rows, done;
+    std::atomic<bool> cancelled;
+};
+
+namespace {
+thread_local std::string lastError;
+
+jc_status fail(jc_status status, const std::string &message) {
+    lastError = message;
+    return status;
+}
+
+// Sizes of the level 1 and level 2 data caches, detected once.
+struct Caches {
+    size_t l1 = 32 << 10, l2 = 256 << 10;
+
+    Caches() {
+#ifdef _WIN32
+        DWORD length = 0;
+        GetLogicalProcessorInformation(nullptr, &length);
+
+        std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+
+        if (info.empty() || !GetLogicalProcessorInformation(info.data(), &length))
+            return;
+
+        for (const SYSTEM_LOGICAL_PROCESSOR_INFORMATION &i : info)
+            if (i.Relationship == RelationCache && i.Cache.Type != CacheInstruction)
+                set(i.Cache.Level, i.Cache.Size);
+#else
+        for (int index = 0;; index++) {
+            std::string path = "/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(index) + "/";
+            std::ifstream level(path + "level"), type(path + "type"), size(path + "size");
+
+            int l;
+            std::string t;
+            size_t kilobytes;
+
+            if (!(level >> l) || !(type >> t) || !(size >> kilobytes))
+                break;
+
+            if (t != "Instruction")
+                set(l, kilobytes << 10);
+        }
+#endif
+    }
+
+private:
+    void set(int level, size_t size) {
+        if (level == 1)
+            l1 = size;
+        else if (level == 2)
+            l2 = size;
+    }
+};
+
+const Caches &caches() {
+    static const Caches caches;
+    return caches;
+}
+
+// Rows evaluated as one tile where a batch is split into tiles. The tile's
+// slices of the inputs, its results and the code's frame should take at
+// most half of L1 so they stay there until the tile is done; formulas too
+// wide for that fall back to L2.
+size_t tileRows(size_t variables, int stackSize, size_t elementSize) {
+    size_t row = (variables + 1) * elementSize;
+    size_t frame = static_cast<size_t>(stackSize) + 64;
+
+    for (size_t cache : { caches().l1, caches().l2 })
+        if (cache / 2 > frame && (cache / 2 - frame) / row >= 8)
+            return std::min<size_t>((cache / 2 - frame) / row, 4096);
+
+    return 8;
+}
+
+// Optimizes and compiles a parsed expression. With `values` the parameters
+// are specialized to them, otherwise they are read from the pool.
+jc_status build(const std::shared_ptr<Node> &tree, const std::vector<double> &values, size_t nvars, size_t nparams, size_t literals, unsigned flags, jc_expr **out) {
+    Optimizer optimizer;
+    Compiler compiler;
+    VM vm;
+
+    Precision precision = flags & JC_SINGLE ? Single : Double;
+
+    optimizer.setPrecision(precision);
+    optimizer.setFastMath((flags & JC_FAST_MATH) != 0);
+    optimizer.setReassociation((flags & JC_REASSOCIATE) != 0);
+    optimizer.setCompensated((flags & JC_COMPENSATED) != 0);
+    optimizer.setFolding(!(flags & JC_NO_FOLD));
+    optimizer.setParameters(values);
+    compiler.setPrecision(precision);
+
+    try {
+        std::unique_ptr<jc_expr> e(new jc_expr);
+
+        e->tree = tree;
+        e->values = values;
+        IR ir(optimizer.optimize(tree));
+        ir.setPrecision(precision);
+        ir.setFastMath((flags & JC_FAST_MATH) != 0);
+        ir.setFolding(!(flags & JC_NO_FOLD));
+        ir.optimize();
+
+        e->function = compiler.compile(ir);
+        e->fObj = vm.compile(e->function, VM::Array, true);
+        e->fScalars = vm.compile(e->function, VM::Scalars, true);
+        e->code = precision == Double ? reinterpret_cast<double (*)(const double *)>(e->fObj.getCode()) : nullptr;
+        e->codeSingle = precision == Single ? reinterpret_cast<float (*)(const float *)>(e->fObj.getCode()) : nullptr;
+        e->variables = nvars;
+        e->parameters = values.empty() ? nparams : 0;
+        e->literals = literals;
+        e->tileRows = tileRows(nvars, e->function.stackSize, precision == Single ? sizeof(float) : sizeof(double));
+        e->flags = flags;
+
+        *out = e.release();
+    } catch (const std::bad_alloc &) {
+        return fail(JC_ERROR_NO_MEMORY, "out of memory");
+    } catch (const std::exception &e) {
+        return fail(JC_ERROR_COMPILE, e.what());
+    } catch (...) {
+        return fail(JC_ERROR_INTERNAL, "internal error");
+    }
+
+    return JC_OK;
+}
+
+// Evaluates rows [first, first + rows), gathering each row's arguments
+// from the columns into a buffer on the stack.
+template <class T>
+void evalRows(T (*code)(const T *), const T *const *columns, size_t variables, size_t first, size_t rows, T *out) {
+    T args[JC_MAX_VARIABLES];
+
+    for (size_t row = first; row < first + rows; row++) {
+        for (size_t i = 0; i < variables; i++)
+            args[i] = columns[i][row];
+
+        out[row] = code(args);
+    }
+}
+
+// A file accessed through a window of mapped pages that moves along it, so
+// files larger than the address space work on 32-bit hosts as well.
+class MappedFile {
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+#else
+    int file = -1;
+#endif
+    bool writable = false;
+    unsigned long long size = 0;
+    void *view = nullptr;
+    size_t viewSize = 0;
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        unmap();
+
+#ifdef _WIN32
+        if (mapping)
+            CloseHandle(mapping);
+
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+#else
+        if (file >= 0)
+            close(file);
+#endif
+    }
+
+    unsigned long long getSize() const {
+        return size;
+    }
+
+    bool open(const char *path) {
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+        LARGE_INTEGER length;
+
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &length))
+            return false;
+
+        size = length.QuadPart;
+
+        return !size || (mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr)) != nullptr;
+#else
+        struct stat info;
+
+        if ((file = ::open(path, O_RDONLY)) < 0 || fstat(file, &info) < 0)
+            return false;
+
+        size = info.st_size;
+
+        return true;
+#endif
+    }
+
+    // Creates or truncates the file and sizes it to `size` bytes.
+    bool create(const char *path, unsigned long long size) {
+        writable = true;
+        this->size = size;
+
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+
+        return !size || (mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr)) != nullptr;
+#else
+        return (file = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) >= 0 && ftruncate(file, size) == 0;
+#endif
+    }
+
+    // Maps [offset, offset + length) in place of the previous window.
+    // `offset` must be a multiple of the allocation granularity (64 KiB
+    // covers every platform).
+    void *map(unsigned long long offset, size_t length) {
+        unmap();
+
+#ifdef _WIN32
+        view = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, static_cast<DWORD>(offset >> 32), static_cast<DWORD>(offset), length);
+#else
+        view = mmap(nullptr, length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file, offset);
+
+        if (view == MAP_FAILED)
+            view = nullptr;
+        else
+            madvise(view, length, MADV_SEQUENTIAL);
+#endif
+
+        viewSize = view ? length : 0;
+
+        return view;
+    }
+
+    // Starts reading [offset, offset + length) into the page cache while
+    // the current window is processed. The system's own sequential
+    // read-ahead does this on Windows.
+    void prefetch(unsigned long long offset, size_t length) {
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+        posix_fadvise(file, offset, length, POSIX_FADV_WILLNEED);
+#else
+        (void)offset;
+        (void)length;
+#endif
+    }
+
+private:
+    void unmap() {
+        if (!view)
+            return;
+
+#ifdef _WIN32
+        UnmapViewOfFile(view);
+#else
+        munmap(view, viewSize);
+#endif
+
+        view = nullptr;
+        viewSize = 0;
+    }
+};
+
+template <class T>
+jc_status evalFiles(const jc_expr *e, T (*code)(const T *), const char *const *inputs, const char *output, size_t *rows) {
+    // Window moved along every file at a time.
+    const size_t windowRows = (16 << 20) / sizeof(T);
+
+    std::vector<std::unique_ptr<MappedFile>> columns;
+    unsigned long long count = *rows;
+
+    for (size_t i = 0; i < e->variables; i++) {
+        columns.emplace_back(new MappedFile);
+
+        if (!columns[i]->open(inputs[i]))
+            return fail(JC_ERROR_IO, std::string("can't open '") + inputs[i] + "'");
+
+        if (columns[i]->getSize() % sizeof(T) || (i && columns[i]->getSize() / sizeof(T) != count))
+            return fail(JC_ERROR_IO, std::string("'") + inputs[i] + "' has a different length");
+
+        count = columns[i]->getSize() / sizeof(T);
+    }
+
+    if (count != static_cast<size_t>(count))
+        return fail(JC_ERROR_IO, "too many rows");
+
+    MappedFile result;
+
+    if (!result.create(output, count * sizeof(T)))
+        return fail(JC_ERROR_IO, std::string("can't create '") + output + "'");
+
+    std::vector<const T *> pointers(e->variables);
+
+    for (unsigned long long begin = 0; begin < count; begin += windowRows) {
+        size_t n = static_cast<size_t>(std::min<unsigned long long>(windowRows, count - begin));
+
+        for (size_t i = 0; i < e->variables; i++) {
+            if (!(pointers[i] = static_cast<const T *>(columns[i]->map(begin * sizeof(T), n * sizeof(T)))))
+                return fail(JC_ERROR_IO, std::string("can't map '") + inputs[i] + "'");
+
+            if (begin + n < count)
+                columns[i]->prefetch((begin + n) * sizeof(T), static_cast<size_t>(std::min<unsigned long long>(windowRows, count - begin - n)) * sizeof(T));
+        }
+
+        T *out = static_cast<T *>(result.map(begin * sizeof(T), n * sizeof(T)));
+
+        if (!out)
+            return fail(JC_ERROR_IO, std::string("can't map '") + output + "'");
+
+        for (size_t tile = 0; tile < n; tile += e->tileRows)
+            evalRows(code, pointers.data(), e->variables, tile, std::min(e->tileRows, n - tile), out);
+    }
+
+    *rows = static_cast<size_t>(count);
+
+    return JC_OK;
+}
+
+// Storage behind an exported array: the buffer pointers and one block
+// holding the validity bitmap and the values, both 64-byte aligned.
+struct ArrowOutput {
+    const void *buffers[2];
+    std::vector<unsigned char> storage;
+
+    static void release(ArrowArray *array) {
+        delete static_cast<ArrowOutput *>(array->private_data);
+        array->release = nullptr;
+    }
+
+    static void releaseSchema(ArrowSchema *schema) {
+        schema->release = nullptr;
+    }
+};
+
+// Like VM::runBatch, through the compiled code: validity is ANDed a word
+// of 64 rows at a time, blocks without a valid row are skipped and only
+// valid rows are run.
+template <class T>
+size_t evalMasked(T (*code)(const T *), const Column<T> *columns, size_t variables, size_t rows, T *out, byte *validity) {
+    T args[JC_MAX_VARIABLES];
+    size_t nulls = 0;
+
+    for (size_t block = 0; block < rows; block += 64) {
+        size_t n = std::min<size_t>(64, rows - block);
+        uint64_t mask = n < 64 ? (static_cast<uint64_t>(1) << n) - 1 : ~static_cast<uint64_t>(0);
+
+        for (size_t i = 0; i < variables && mask; i++)
+            if (columns[i].validity)
+                mask &= validityWord(columns[i].validity, columns[i].offset + block, n);
+
+        if (validity)
+            for (size_t i = 0; i < (n + 7) / 8; i++)
+                validity[block / 8 + i] = static_cast<byte>(mask >> (i * 8));
+
+        for (size_t row = 0; row < n; row++)
+            if (mask >> row & 1) {
+                for (size_t i = 0; i < variables; i++)
+                    args[i] = columns[i].values[block + row];
+
+                out[block + row] = code(args);
+            } else {
+                out[block + row] = 0;
+                nulls++;
+            }
+    }
+
+    return nulls;
+}
+
+template <class T>
+jc_status evalBatchMasked(const jc_expr *e, T (*code)(const T *), const T *const *columns, const uint8_t *const *validity, size_t rows, T *out, uint8_t *outValidity) {
+    std::vector<Column<T>> inputs(e->variables);
+
+    for (size_t i = 0; i < e->variables; i++)
+        inputs[i] = Column<T> { columns[i], validity ? validity[i] : nullptr, 0 };
+
+    evalMasked(code, inputs.data(), e->variables, rows, out, outValidity);
+
+    return JC_OK;
+}
+
+template <class T>
+jc_status evalArrow(const jc_expr *e, T (*code)(const T *), const char *format, const ArrowSchema *schema, const ArrowArray *batch, jc_nulls nulls, ArrowArray *out, ArrowSchema *outSchema) {
+    if (strcmp(schema->format, "+s") || batch->n_children != schema->n_children || batch->null_count > 0)
+        return fail(JC_ERROR_INVALID_ARGUMENT, "expected a record batch");
+
+    if (static_cast<size_t>(batch->n_children) != e->variables)
+        return fail(JC_ERROR_INVALID_ARGUMENT, "expected a column per variable");
+
+    for (int64_t i = 0; i < batch->n_children; i++)
+        if (strcmp(schema->children[i]->format, format) || batch->children[i]->n_buffers != 2 || batch->children[i]->length < batch->offset + batch->length)
+            return fail(JC_ERROR_INVALID_ARGUMENT, std::string("column ") + std::to_string(i) + " is not of type '" + format + "'");
+
+    size_t rows = static_cast<size_t>(batch->length);
+    size_t bitmapSize = nulls == JC_NULLS_PROPAGATE ? (rows + 511) / 512 * 64 : 0;
+
+    std::unique_ptr<ArrowOutput> output(new ArrowOutput);
+    output->storage.resize(bitmapSize + rows * sizeof(T) + 64);
+
+    unsigned char *base = output->storage.data() + (64 - reinterpret_cast<uintptr_t>(output->storage.data()) % 64) % 64;
+    unsigned char *bitmap = bitmapSize ? base : nullptr;
+    T *values = reinterpret_cast<T *>(base + bitmapSize);
+
+    std::vector<Column<T>> columns;
+
+    for (int64_t i = 0; i < batch->n_children; i++) {
+        const ArrowArray *column = batch->children[i];
+        size_t offset = static_cast<size_t>(column->offset + batch->offset);
+
+        columns.push_back(Column<T> { static_cast<const T *>(column->buffers[1]) + offset, column->null_count ? static_cast<const byte *>(column->buffers[0]) : nullptr, offset });
+    }
+
+    int64_t nullCount = 0;
+
+    if (bitmap)
+        nullCount = evalMasked(code, columns.data(), columns.size(), rows, values, bitmap);
+    else {
+        T args[JC_MAX_VARIABLES];
+
+        for (size_t row = 0; row < rows; row++) {
+            for (size_t i = 0; i < columns.size(); i++) {
+                const Column<T> &column = columns[i];
+                bool valid = !column.validity || (column.validity[(column.offset + row) >> 3] >> ((column.offset + row) & 7) & 1);
+
+                args[i] = valid ? column.values[row] : NAN;
+            }
+
+            values[row] = code(args);
+        }
+    }
+
+    output->buffers[0] = bitmap;
+    output->buffers[1] = values;
+
+    out->length = batch->length;
+    out->null_count = nullCount;
+    out->offset = 0;
+    out->n_buffers = 2;
+    out->n_children = 0;
+    out->buffers = output->buffers;
+    out->children = nullptr;
+    out->dictionary = nullptr;
+    out->release = &ArrowOutput::release;
+    out->private_data = output.release();
+
+    if (outSchema) {
+        outSchema->format = format;
+        outSchema->name = "";
+        outSchema->metadata = nullptr;
+        outSchema->flags = nulls == JC_NULLS_PROPAGATE ? ARROW_FLAG_NULLABLE : 0;
+        outSchema->n_children = 0;
+        outSchema->children = nullptr;
+        outSchema->dictionary = nullptr;
+        outSchema->release = &ArrowOutput::releaseSchema;
+        outSchema->private_data = nullptr;
+    }
+
+    return JC_OK;
+}
+
+// CPUs of each NUMA node the process may run on, detected once. Without
+// NUMA information it is a single node, and `pinned` is false if the CPUs
+// aren't known either.
+struct Topology {
+    std::vector<std::vector<int>> nodes;
+    bool pinned = true;
+
+    Topology() {
+#ifdef _WIN32
+        ULONG highest;
+        DWORD_PTR process, system;
+
+        if (GetNumaHighestNodeNumber(&highest) && GetProcessAffinityMask(GetCurrentProcess(), &process, &system))
+            for (ULONG node = 0; node <= highest; node++) {
+                ULONGLONG mask;
+                std::vector<int> cpus;
+
+                if (GetNumaNodeProcessorMask(static_cast<UCHAR>(node), &mask))
+                    for (int cpu = 0; cpu < static_cast<int>(sizeof(DWORD_PTR) * 8); cpu++)
+                        if (mask & process & (static_cast<DWORD_PTR>(1) << cpu))
+                            cpus.push_back(cpu);
+
+                if (!cpus.empty())
+                    nodes.push_back(cpus);
+            }
+#else
+        cpu_set_t allowed;
+        bool affinity = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+        for (int node = 0; affinity && node < 1024; node++) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string list;
+
+            if (!(file >> list))
+                continue;
+
+            std::vector<int> cpus;
+            std::istringstream ranges(list);
+            std::string range;
+
+            // "0-3,8-11"
+            while (std::getline(ranges, range, ',')) {
+                int first = std::atoi(range.c_str()), last = first;
+                size_t dash = range.find('-');
+
+                if (dash != std::string::npos)
+                    last = std::atoi(range.c_str() + dash + 1);
+
+                for (int cpu = first; cpu <= last; cpu++)
+                    if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                        cpus.push_back(cpu);
+            }
+
+            if (!cpus.empty())
+                nodes.push_back(cpus);
+        }
+#endif
+
+        if (nodes.empty()) {
+            nodes.push_back(std::vector<int>());
+            pinned = false;
+
+            for (unsigned cpu = 0; cpu < std::max(std::thread::hardware_concurrency(), 1u); cpu++)
+                nodes[0].push_back(cpu);
+        }
+    }
+
+    size_t cpus() const {
+        size_t count = 0;
+
+        for (const std::vector<int> &node : nodes)
+            count += node.size();
+
+        return count;
+    }
+
+    void pin(int cpu) const {
+        if (!pinned)
+            return;
+
+#ifdef _WIN32
+        SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu);
+#else
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+#endif
+    }
+};
+
+const Topology &topology() {
+    static const Topology topology;
+    return topology;
+}
+
+// Size of a memory page, queried once: the unit first-touch placement and
+// column headers work in.
+size_t pageSize() {
+    static const size_t size = []() {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return static_cast<size_t>(info.dwPageSize);
+#else
+        long size = sysconf(_SC_PAGESIZE);
+        return size > 0 ? static_cast<size_t>(size) : 4096;
+#endif
+    }();
+
+    return size;
+}
+
+// How `rows` rows are split among `threads` workers (0 for one per CPU).
+// Workers are spread over the nodes round-robin, and each node gets one
+// contiguous range of rows, split among its workers on page boundaries.
+// The split depends only on the arguments, so jc_alloc_column and
+// jc_eval_batch_parallel agree on which node owns which rows.
+struct Worker {
+    int node, cpu;
+    size_t begin, end;
+};
+
+std::vector<Worker> partition(size_t rows, unsigned threads, size_t elementSize) {
+    const Topology &t = topology();
+    const size_t nodes = t.nodes.size();
+    const size_t page = std::max<size_t>(pageSize() / elementSize, 1);
+
+    size_t count = threads ? threads : t.cpus();
+    count = std::max<size_t>(std::min(count, (rows + page - 1) / page), 1);
+
+    std::vector<Worker> workers;
+
+    for (size_t node = 0; node < nodes; node++)
+        for (size_t w = node; w < count; w += nodes)
+            workers.push_back(Worker { static_cast<int>(node), t.nodes[node][(w / nodes) % t.nodes[node].size()], 0, 0 });
+
+    size_t pages = (rows + page - 1) / page;
+
+    for (size_t w = 0; w < workers.size(); w++) {
+        workers[w].begin = std::min(pages * w / workers.size() * page, rows);
+        workers[w].end = std::min(pages * (w + 1) / workers.size() * page, rows);
+    }
+
+    return workers;
+}
+
+// Runs job(worker) for every worker on its own thread pinned to its CPU.
+// The first exception a job throws is rethrown once all of them are done;
+// if a thread cannot be started, the ones already running are joined
+// before the std::system_error is passed on.
+template <class Job>
+void parallel(const std::vector<Worker> &workers, Job job) {
+    std::vector<std::thread> threads;
+    std::exception_ptr error;
+    std::mutex mutex;
+
+    auto run = [&](const Worker &worker) {
+        try {
+            topology().pin(worker.cpu);
+            job(worker);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (!error)
+                error = std::current_exception();
+        }
+    };
+
+    try {
+        threads.reserve(workers.size());
+
+        for (const Worker &worker : workers)
+            threads.emplace_back([&run, &worker]() { run(worker); });
+    } catch (...) {
+        for (std::thread &thread : threads)
+            thread.join();
+
+        throw;
+    }
+
+    for (std::thread &thread : threads)
+        thread.join();
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+template <class T>
+jc_status evalParallel(const jc_expr *e, T (*code)(const T *), const T *const *columns, size_t rows, T *out, unsigned threads, unsigned options) {
+    std::vector<Worker> workers = partition(rows, threads, sizeof(T));
+
+    std::shared_ptr<jc_replicas> replicas;
+
+    if (options & JC_PARALLEL_REPLICATE) {
+        std::lock_guard<std::mutex> lock(e->replicasMutex);
+
+        if (!e->replicas) {
+            size_t nodes = topology().nodes.size();
+
+            e->replicas = std::make_shared<jc_replicas>();
+            e->replicas->code.resize(nodes);
+            e->replicas->compiled.reset(new std::once_flag[nodes]);
+        }
+
+        replicas = e->replicas;
+    }
+
+    parallel(workers, [&](const Worker &worker) {
+        T (*f)(const T *) = code;
+
+        if (replicas) {
+            x86::Function &replica = replicas->code[worker.node];
+
+            // A failed compile leaves the flag unset for the next worker
+            // to retry, and its exception fails the evaluation.
+            std::call_once(replicas->compiled[worker.node], [&]() {
+                replica = VM().compile(e->function, VM::Array);
+            });
+
+            f = reinterpret_cast<T (*)(const T *)>(replica.getCode());
+        }
+
+        evalRows(f, columns, e->variables, worker.begin, worker.end - worker.begin, out);
+    });
+
+    return JC_OK;
+}
+}
+
+jc_status jc_compile(const char *expr, const char *const *vars, size_t nvars, jc_expr **out) {
+    return jc_compile_ex(expr, vars, nvars, 0, out);
+}
+
+jc_status jc_compile_ex(const char *expr, const char *const *vars, size_t nvars, unsigned flags, jc_expr **out) {
+    return jc_compile_params(expr, vars, nvars, nullptr, 0, flags, out);
+}
+
+jc_status jc_compile_params(const char *expr, const char *const *vars, size_t nvars, const char *const *params, size_t nparams, unsigned flags, jc_expr **out) {
+    if (!expr || !out || (nvars && !vars) || (nparams && !params))
+        return fail(JC_ERROR_INVALID_ARGUMENT, "invalid argument");
+
+    if (nvars > JC_MAX_VARIABLES)
+        return fail(JC_ERROR_INVALID_ARGUMENT, "too many variables");
+
+    *out = nullptr;
+
+    Lexer lexer;
+    Parser parser;
+
+    std::shared_ptr<Node> tree;
+
+    try {
+        parser.setVariables(std::vector<std::string>(vars, vars + nvars));
+        parser.setParameters(std::vector<std::string>(params, params + nparams));
+        tree = parser.parse(lexer.lex(expr));
+    } catch (const std::bad_alloc &) {
+        return fail(JC_ERROR_NO_MEMORY, "out of memory");
+    } catch (const std::exception &e) {
+        return fail(JC_ERROR_PARSE, e.what());
+    }
+
+    return build(tree, std::vector<double>(), nvars, nparams, parser.getLiteralCount(), flags, out);
+}
+
+jc_status jc_specialize(const jc_expr *e, const double *values, jc_expr **out) {
+    if (!e || !out || (e->parameters && !values))
+        return fail(JC_ERROR_INVALID_ARGUMENT, "invalid argument");
+
+    *out = nullptr;
+
+    if (!e->parameters)
+        return build(e->tree, e->values, e->variables, 0, e->literals, e->flags, out);
+
+    return build(e->tree, std::vector<double>(values, values + e->parameters), e->variables, e->parameters, e->literals, e->flags, out);
+}
+
+jc_status jc_eval(const jc_expr *e, const double *args, double *result) {
+    if (!e || !result || (e->variables && !args))
+        return JC_ERROR_INVALID_ARGUMENT;
+
+    if (!e->code)
+        return JC_ERROR_PRECISION;
+
+    *result = e->code(args);
+
+    return JC_OK;
+}
+
+jc_status jc_eval_f32(const jc_expr *e, const float *args, float *result) {
+    if (!e || !result || (e->variables && !args))
+        return JC_ERROR_INVALID_ARGUMENT;
+
+    if (!e->codeSingle)
+        return JC_ERROR_PRECISION;
+
+    *result = e->codeSingle(args);
+
+    return JC_OK;
+}
+
+jc_status jc_eval_batch(const jc_expr *e, const double *const *columns, size_t rows, double *out) {
+    if (!e || (rows && !out) || (e->variables && !columns))
+        return JC_ERROR_INVALID_ARGUMENT;
+
+    if (!e->code)
+        return JC_ERROR_PRECISION;
+
+    evalRows(e->code, columns, e->variables, 0, rows, out);
+
+    return JC_OK;
+}
+
+jc_status jc_eval_batch_f32(const jc_expr *e, const float *const *columns, size_t rows, float *out) {
+    if (!e || (rows && !out) || (e->variables && !columns))
+        return JC_ERROR_INVALID_ARGUMENT;
+
+    if (!e->codeSingle)
+        return JC_ERROR_PRECISION;
+
+    evalRows(e->codeSingle, columns, e->variables, 0, rows, out);
+
+    return JC_OK;
+}
+
+jc_status jc_eval_batch_masked(const jc_expr *e, const double *const *columns, const uint8_t *const *validity, size_t rows, double *out, uint8_t *out_validity) {
+    if (!e || (rows && !out) || (e->variables && !columns))
+        return JC_ERROR_INVALID_ARGUMENT;
+
+    if (!e->code)
+        return JC_ERROR_PRECISION;
+
+    return evalBatchMasked(e, e->code, columns, validity, rows, out, out_validity);
+}
+
+jc_status jc_eval_batch_masked_f32(const jc_expr *e, const float *const *columns, const uint8_t *const *validity, size_t rows, float *out, uint8_t *out_validity) {
+    if (!e || (rows && !out) || (e->variables && !columns))
+        return JC_ERROR_INVALID_ARGUMENT;
+
+    if (!e->codeSingle)
+        return JC_ERROR_PRECISION;
+
+    return evalBatchMasked(e, e->codeSingle, columns, validity, rows, out, out_validity);
+}
+
+jc_status jc_eval_batch_parallel(const jc_expr *e, const double *const *columns, size_t rows, double *out, unsigned threads, unsigned options) {
+    if (!e || (rows && !out) || (e->variables && !columns))
+        return JC_ERROR_INVALID_ARGUMENT;
+
+    if (!e->code)
+        return JC_ERROR_PRECISION;
+
+    try {
+        return evalParallel(e, e->code, columns, rows, out, threads, options);
+    } catch (const std::bad_alloc &) {
+        return JC_ERROR_NO_MEMORY;
+    } catch (const std::system_error &) {
+        return JC_ERROR_INTERNAL;
+    } catch (const std::exception &error) {
+        return fail(JC_ERROR_COMPILE, error.what());
+    } catch (...) {
+        return JC_ERROR_INTERNAL;
+    }
+}
+
+jc_status jc_eval_batch_parallel_f32(const jc_expr *e, const float *const *columns, size_t rows, float *out, unsigned threads, unsigned options) {
+    if (!e || (rows && !out) || (e->variables && !columns))
+        return JC_ERROR_INVALID_ARGUMENT;
+
+    if (!e->codeSingle)
+        return JC_ERROR_PRECISION;
+
+    try {
+        return evalParallel(e, e->codeSingle, columns, rows, out, threads, options);
+    } catch (const std::bad_alloc &) {
+        return JC_ERROR_NO_MEMORY;
+    } catch (const std::system_error &) {
+        return JC_ERROR_INTERNAL;
+    } catch (const std::exception &error) {
+        return fail(JC_ERROR_COMPILE, error.what());
+    } catch (...) {
+        return JC_ERROR_INTERNAL;
+    }
+}
+
+// The block starts with a page holding its size, so the column itself is
+// page aligned and its pages are only backed once they are touched.
+void *jc_alloc_column(size_t rows, size_t element_size, unsigned threads) {
+    const size_t header = pageSize();
+
+    if (!element_size || rows > (static_cast<size_t>(-1) - header) / element_size)
+        return nullptr;
+
+    size_t size = header + rows * element_size;
+
+#ifdef _WIN32
+    void *block = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void *block = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (block == MAP_FAILED)
+        block = nullptr;
+#endif
+
+    if (!block)
+        return nullptr;
+
+    *static_cast<size_t *>(block) = size;
+
+    unsigned char *column = static_cast<unsigned char *>(block) + header;
+
+    try {
+        parallel(partition(rows, threads, element_size), [&](const Worker &worker) {
+            memset(column + worker.begin * element_size, 0, (worker.end - worker.begin) * element_size);
+        });
+    } catch (...) {
+        memset(column, 0, rows * element_size);
+    }
+
+    return column;
+}
+
+void jc_free_column(void *column) {
+    if (!column)
+        return;
+
+    void *block = static_cast<unsigned char *>(column) - pageSize();
+
+#ifdef _WIN32
+    VirtualFree(block, 0, MEM_RELEASE);
+#else
+    munmap(block, *static_cast<size_t *>(block));
+#endif
+}
+
+jc_status jc_eval_files(const jc_expr *e, const char *const *inputs, const char *output, size_t *rows) {
+    if (!e || !output || !rows || (e->variables && !inputs))
+        return fail(JC_ERROR_INVALID_ARGUMENT, "invalid argument");
+
+    try {
+        return e->code ? evalFiles(e, e->code, inputs, output, rows) : evalFiles(e, e->codeSingle, inputs, output, rows);
+    } catch (const std::bad_alloc &) {
+        return fail(JC_ERROR_NO_MEMORY, "out of memory");
+    }
+}
+
+jc_status jc_eval_arrow(const jc_expr *e, const ArrowSchema *schema, const ArrowArray *batch, jc_nulls nulls, ArrowArray *out, ArrowSchema *outSchema) {
+    if (!e || !schema || !batch || !out || (nulls != JC_NULLS_AS_NAN && nulls != JC_NULLS_PROPAGATE))
+        return fail(JC_ERROR_INVALID_ARGUMENT, "invalid argument");
+
+    try {
+        return e->code ? evalArrow(e, e->code, "g", schema, batch, nulls, out, outSchema) : evalArrow(e, e->codeSingle, "f", schema, batch, nulls, out, outSchema);
+    } catch (const std::bad_alloc &) {
+        return fail(JC_ERROR_NO_MEMORY, "out of memory");
+    }
+}
+
+jc_status jc_function(const jc_expr *e, jc_signature signature, void **fn) {
+    if (!e || !fn)
+        return JC_ERROR_INVALID_ARGUMENT;
+
+    switch (signature) {
+    case JC_SIGNATURE_ARRAY:
+        *fn = reinterpret_cast<void *>(e->fObj.getCode());
+        return JC_OK;
+
+    case JC_SIGNATURE_SCALARS:
+        *fn = reinterpret_cast<void *>(e->fScalars.getCode());
+        return JC_OK;
+    }
+
+    return JC_ERROR_INVALID_ARGUMENT;
+}
+
+jc_status jc_rebind(jc_expr *e, size_t literal, double value) {
+    if (!e || literal >= e->literals)
+        return JC_ERROR_INVALID_ARGUMENT;
+
+    if (!e->function.rebind(static_cast<int>(literal), value))
+        return JC_ERROR_FOLDED;
+
+    e->replicas.reset();
+
+    return JC_OK;
+}
+
+jc_status jc_set_param(jc_expr *e, size_t index, double value) {
+    if (!e || index >= e->parameters)
+        return JC_ERROR_INVALID_ARGUMENT;
+
+    e->function.setParameter(static_cast<int>(index), value);
+    e->replicas.reset();
+
+    return JC_OK;
+}
+
+namespace {
+jc_status createJob(const jc_expr *e, const void *const *columns, size_t rows, void *out, jc_job **job) {
+    if (!e || !job || (rows && !out) || (e->variables && !columns))
+        return JC_ERROR_INVALID_ARGUMENT;
+
+    jc_job *j = new (std::nothrow) jc_job;
+
+    if (!j)
+        return JC_ERROR_NO_MEMORY;
+
+    try {
+        j->columns.assign(columns, columns + e->variables);
+    } catch (const std::bad_alloc &) {
+        delete j;
+        return JC_ERROR_NO_MEMORY;
+    }
+
+    j->e = e;
+    j->out = out;
+    j->rows = rows;
+    j->done = 0;
+    j->cancelled = false;
+
+    *job = j;
+
+    return JC_OK;
+}
+
+template <class T>
+void runJob(jc_job *job, T (*code)(const T *), size_t rows, double seconds) {
+    typedef std::chrono::steady_clock Clock;
+
+    Clock::time_point deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    size_t end = std::min(job->rows, rows ? job->done + rows : job->rows);
+
+    // The clock and the cancellation flag are checked once per tile.
+    while (job->done < end && !job->cancelled.load(std::memory_order_relaxed)) {
+        size_t n = std::min(std::max<size_t>(job->e->tileRows, 256), end - job->done);
+
+        evalRows(code, reinterpret_cast<const T *const *>(job->columns.data()), job->e->variables, job->done, n, static_cast<T *>(job->out));
+        job->done += n;
+
+        if (seconds > 0 && Clock::now() >= deadline)
+            break;
+    }
+}
+}
+
+jc_status jc_job_create(const jc_expr *e, const double *const *columns, size_t rows, double *out, jc_job **job) {
+    if (e && !e->code)
+        return JC_ERROR_PRECISION;
+
+    return createJob(e, reinterpret_cast<const void *const *>(columns), rows, out, job);
+}
+
+jc_status jc_job_create_f32(const jc_expr *e, const float *const *columns, size_t rows, float *out, jc_job **job) {
+    if (e && !e->codeSingle)
+        return JC_ERROR_PRECISION;
+
+    return createJob(e, reinterpret_cast<const void *const *>(columns), rows, out, job);
+}
+
+jc_status jc_job_run(jc_job *job, size_t rows, double seconds) {
+    if (!job)
+        return JC_ERROR_INVALID_ARGUMENT;
+
+    try {
+        if (job->e->code)
+            runJob(job, job->e->code, rows, seconds);
+        else
+            runJob(job, job->e->codeSingle, rows, seconds);
+    } catch (const std::bad_alloc &) {
+        return JC_ERROR_NO_MEMORY;
+    }
+
+    return job->cancelled ? JC_ERROR_CANCELLED : JC_OK;
+}
+
+void jc_job_cancel(jc_job *job) {
+    if (job)
+        job->cancelled = true;
+}
+
+int jc_job_finished(const jc_job *job) {
+    return !job || job->done == job->rows || job->cancelled;
+}
+
+size_t jc_job_progress(const jc_job *job) {
+    return job ? job->done : 0;
+}
+
+void jc_job_free(jc_job *job) {
+    delete job;
+}
+
+void jc_free(jc_expr *e) {
+    delete e;
+}
+
+size_t jc_variable_count(const jc_expr *e) {
+    return e ? e->variables : 0;
+}
+
+size_t jc_param_count(const jc_expr *e) {
+    return e ? e->parameters : 0;
+}
+
+size_t jc_literal_count(const jc_expr *e) {
+    return e ? e->literals : 0;
+}
+
+unsigned jc_flags(const jc_expr *e) {
+    return e ? e->flags : 0;
+}
+
+const char *jc_strerror(jc_status status) {
+    switch (status) {
+    case JC_OK:
+        return "ok";
+    case JC_ERROR_INVALID_ARGUMENT:
+        return "invalid argument";
+    case JC_ERROR_PARSE:
+        return "parse error";
+    case JC_ERROR_COMPILE:
+        return "compile error";
+    case JC_ERROR_NO_MEMORY:
+        return "out of memory";
+    case JC_ERROR_INTERNAL:
+        return "internal error";
+    case JC_ERROR_PRECISION:
+        return "expression was compiled for another precision";
+    case JC_ERROR_FOLDED:
+        return "literal was folded into another constant";
+    case JC_ERROR_IO:
+        return "file error";
+    case JC_ERROR_CANCELLED:
+        return "cancelled";
+    }
+
+    return "unknown error";
+}
+
+const char *jc_last_error(void) {
+    return lastError.c_str();
+}
@@ -0,0 +1,284 @@
+#ifndef JC_H
+#define JC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32) && defined(JC_BUILD_SHARED)
+#define JC_API __declspec(dllexport)
+#elif defined(_WIN32) && defined(JC_USE_SHARED)
+#define JC_API __declspec(dllimport)
+#else
+#define JC_API
+#endif
+
+/* Upper bound on the number of variables an expression may bind. */
+#define JC_MAX_VARIABLES 256
+
+typedef enum jc_status {
+    JC_OK = 0,
+    JC_ERROR_INVALID_ARGUMENT,
+    JC_ERROR_PARSE,
+    JC_ERROR_COMPILE,
+    JC_ERROR_NO_MEMORY,
+    JC_ERROR_INTERNAL,
+    JC_ERROR_PRECISION,
+    JC_ERROR_FOLDED,
+    JC_ERROR_IO,
+    JC_ERROR_CANCELLED
+} jc_status;
+
+/* jc_compile_ex flags. */
+#define JC_SINGLE 0x1u      /* float32 constants, arguments and arithmetic; use the *_f32 entry points */
+#define JC_FAST_MATH 0x2u   /* JC_REASSOCIATE, reciprocal division by constants, multiply-add contraction */
+#define JC_REASSOCIATE 0x4u /* rebuild +/- and * / chains as balanced trees */
+#define JC_COMPENSATED 0x8u /* compensated (Neumaier) summation of +/- chains */
+#define JC_NO_FOLD 0x10u    /* keep every numeric literal rebindable, see jc_rebind */
+
+typedef struct jc_expr jc_expr;
+typedef struct jc_job jc_job;
+
+/* Apache Arrow C data interface, as given by its specification. */
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+    const char *format;
+    const char *name;
+    const char *metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema **children;
+    struct ArrowSchema *dictionary;
+    void (*release)(struct ArrowSchema *);
+    void *private_data;
+};
+
+struct ArrowArray {
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void **buffers;
+    struct ArrowArray **children;
+    struct ArrowArray *dictionary;
+    void (*release)(struct ArrowArray *);
+    void *private_data;
+};
+
+#endif
+
+/* What a null input means to jc_eval_arrow. */
+typedef enum jc_nulls {
+    JC_NULLS_AS_NAN = 0, /* a null reads as NaN; the result has no validity bitmap */
+    JC_NULLS_PROPAGATE   /* a row with a null input is not evaluated and its result is null */
+} jc_nulls;
+
+/* Shapes the compiled code can be called through, see jc_function. */
+typedef enum jc_signature {
+    JC_SIGNATURE_ARRAY = 0, /* jc_fn_array, or jc_fn_array_f32 for JC_SINGLE */
+    JC_SIGNATURE_SCALARS    /* jc_fn0 .. jc_fn4, or any double(double, ...) of the expression's arity;
+                               float(float, ...) for JC_SINGLE */
+} jc_signature;
+
+typedef double (*jc_fn_array)(const double *args);
+typedef float (*jc_fn_array_f32)(const float *args);
+typedef double (*jc_fn0)(void);
+typedef double (*jc_fn1)(double);
+typedef double (*jc_fn2)(double, double);
+typedef double (*jc_fn3)(double, double, double);
+typedef double (*jc_fn4)(double, double, double, double);
+
+/* Compiles `expr` with variables named `vars[0..nvars)`; a variable's index
+ * in `vars` is its index in the argument arrays passed to jc_eval*. */
+JC_API jc_status jc_compile(const char *expr, const char *const *vars, size_t nvars, jc_expr **out);
+
+JC_API jc_status jc_compile_ex(const char *expr, const char *const *vars, size_t nvars, unsigned flags, jc_expr **out);
+
+/* Like jc_compile_ex, with parameters named `params[0..nparams)`: values
+ * fixed for a whole batch rather than per row. The code reads them from the
+ * constant pool; they are NaN until set with jc_set_param. */
+JC_API jc_status jc_compile_params(const char *expr, const char *const *vars, size_t nvars, const char *const *params, size_t nparams,
+                                   unsigned flags, jc_expr **out);
+
+/* Compiles a new expression from the same source with the parameters
+ * replaced by `values[0..jc_param_count(e))` as constants, so they are
+ * folded and integer powers expanded. The result has no parameters and is
+ * freed with jc_free independently of `e`. */
+JC_API jc_status jc_specialize(const jc_expr *e, const double *values, jc_expr **out);
+
+/* Evaluates one row. `args` holds one value per variable. */
+JC_API jc_status jc_eval(const jc_expr *e, const double *args, double *result);
+
+/* Evaluates `rows` rows. `columns[i]` is the column of variable i. */
+JC_API jc_status jc_eval_batch(const jc_expr *e, const double *const *columns, size_t rows, double *out);
+
+JC_API jc_status jc_eval_f32(const jc_expr *e, const float *args, float *result);
+
+JC_API jc_status jc_eval_batch_f32(const jc_expr *e, const float *const *columns, size_t rows, float *out);
+
+/* Batch evaluation with missing values. `validity[i]`, if `validity` and it
+ * are not NULL, is a bitmap of column i with bit r (least significant
+ * first, as in Arrow) clear if row r is null. A row with a null input is
+ * not evaluated; its result is 0 and its bit in `out_validity`, which may
+ * be NULL and otherwise holds (rows + 7) / 8 bytes, is cleared. Blocks of
+ * 64 rows without a valid row are skipped as a whole. */
+JC_API jc_status jc_eval_batch_masked(const jc_expr *e, const double *const *columns, const uint8_t *const *validity, size_t rows, double *out,
+                                      uint8_t *out_validity);
+
+JC_API jc_status jc_eval_batch_masked_f32(const jc_expr *e, const float *const *columns, const uint8_t *const *validity, size_t rows, float *out,
+                                          uint8_t *out_validity);
+
+/* jc_eval_batch_parallel options. */
+#define JC_PARALLEL_REPLICATE 0x1u /* run a private copy of the code and constants on each NUMA node */
+
+/* Batch evaluation on `threads` threads, 0 for one per CPU the process may
+ * run on. Threads are pinned to CPUs spread over the NUMA nodes, and each
+ * node evaluates one contiguous range of rows. For node-local memory
+ * traffic, allocate the columns and `out` with jc_alloc_column and the
+ * same `rows` and `threads`. The JC_PARALLEL_REPLICATE copies are made by
+ * the first call that needs them and kept until jc_rebind or jc_set_param
+ * changes the constants; if one fails to compile, the call returns
+ * JC_ERROR_COMPILE with the reason in jc_last_error. */
+JC_API jc_status jc_eval_batch_parallel(const jc_expr *e, const double *const *columns, size_t rows, double *out, unsigned threads,
+                                        unsigned options);
+
+JC_API jc_status jc_eval_batch_parallel_f32(const jc_expr *e, const float *const *columns, size_t rows, float *out, unsigned threads,
+                                            unsigned options);
+
+/* Allocates a page-aligned column of `rows` elements, zeroed by the threads
+ * jc_eval_batch_parallel would use for the same `rows` and `threads`, so
+ * each page lands on the NUMA node that evaluates its rows (first touch).
+ * Returns NULL on failure; free it with jc_free_column. */
+JC_API void *jc_alloc_column(size_t rows, size_t element_size, unsigned threads);
+
+JC_API void jc_free_column(void *column);
+
+/* Resumable batch evaluation, for event loops that can't block on a whole
+ * batch: the job evaluates a chunk per jc_job_run and keeps its position.
+ * The columns, `out` and `e` must stay valid until jc_job_free. See
+ * jc_async.h for a C++20 coroutine interface. */
+JC_API jc_status jc_job_create(const jc_expr *e, const double *const *columns, size_t rows, double *out, jc_job **job);
+
+JC_API jc_status jc_job_create_f32(const jc_expr *e, const float *const *columns, size_t rows, float *out, jc_job **job);
+
+/* Evaluates up to `rows` more rows (0 for no limit), returning early once
+ * `seconds` have passed (0 for no limit); the budget is checked between
+ * tiles of a few hundred rows. Returns JC_ERROR_CANCELLED after
+ * jc_job_cancel. */
+JC_API jc_status jc_job_run(jc_job *job, size_t rows, double seconds);
+
+/* Stops the job at the next tile; may be called from any thread. */
+JC_API void jc_job_cancel(jc_job *job);
+
+/* Nonzero once every row is evaluated or the job is cancelled. */
+JC_API int jc_job_finished(const jc_job *job);
+
+/* Number of rows evaluated so far, from the first. */
+JC_API size_t jc_job_progress(const jc_job *job);
+
+JC_API void jc_job_free(jc_job *job);
+
+/* Batch evaluation over flat binary files of native doubles (floats for
+ * JC_SINGLE). `inputs[i]` is the column of variable i; all must have the
+ * same length. `output` is created or truncated and receives one result per
+ * row. Files are memory-mapped a window at a time and read ahead, so they
+ * need not fit in memory. `*rows` receives the row count; for an
+ * expression without variables it gives the count on entry. */
+JC_API jc_status jc_eval_files(const jc_expr *e, const char *const *inputs, const char *output, size_t *rows);
+
+/* Batch evaluation of an Arrow record batch: a struct array whose i-th
+ * child is the column of variable i, float64 ("g"), or float32 ("f") for
+ * JC_SINGLE. Values are read in place. `out` receives a new array of the
+ * same type and length with 64-byte aligned buffers, which the caller
+ * releases through its release callback; `out_schema` may be NULL. */
+JC_API jc_status jc_eval_arrow(const jc_expr *e, const struct ArrowSchema *schema, const struct ArrowArray *batch, jc_nulls nulls,
+                               struct ArrowArray *out, struct ArrowSchema *out_schema);
+
+/* Returns the machine code specialized for `signature`; cast `*fn` to the
+ * matching jc_fn* type. The pointer stays valid until jc_free(e). */
+JC_API jc_status jc_function(const jc_expr *e, jc_signature signature, void **fn);
+
+/* Gives the literal-th number of the source (in order of appearance) a new
+ * value. Only the constant pool is rewritten; the compiled code and any
+ * function pointers from jc_function stay valid. Must not run concurrently
+ * with evaluation of the same expression. Returns JC_ERROR_FOLDED if
+ * constant folding merged the literal with others (see JC_NO_FOLD); a
+ * literal with a leading minus stays bindable. */
+JC_API jc_status jc_rebind(jc_expr *e, size_t literal, double value);
+
+JC_API size_t jc_literal_count(const jc_expr *e);
+
+/* Sets the index-th parameter for the following evaluations. Like
+ * jc_rebind it only rewrites the constant pool and must not run
+ * concurrently with evaluation of the same expression. */
+JC_API jc_status jc_set_param(jc_expr *e, size_t index, double value);
+
+JC_API size_t jc_param_count(const jc_expr *e);
+
+JC_API void jc_free(jc_expr *e);
+
+JC_API size_t jc_variable_count(const jc_expr *e);
+
+/* Flags the expression was compiled with. */
+JC_API unsigned jc_flags(const jc_expr *e);
+
+/* Concurrent registry of compiled expressions by name. Lookups are lock
+ * and allocation free; publishing takes a writer-only lock, and replaced
+ * expressions are freed once no reader can still be using them. */
+typedef struct jc_registry jc_registry;
+typedef struct jc_reader jc_reader;
+
+JC_API jc_registry *jc_registry_create(void);
+
+/* Frees the registry and every expression in it. No reader may be
+ * attached. */
+JC_API void jc_registry_destroy(jc_registry *registry);
+
+/* Makes `e` the expression named `name`, taking ownership of it; NULL
+ * removes the name. The expression it replaces is freed once every reader
+ * that could have looked it up has unlocked. `e` is freed if the call
+ * fails, except that one the registry already owns, under this or another
+ * name or replaced and not yet freed, is rejected with
+ * JC_ERROR_INVALID_ARGUMENT and left as it is. Republishing the
+ * expression a name already has does nothing. */
+JC_API jc_status jc_registry_publish(jc_registry *registry, const char *name, jc_expr *e);
+
+/* Frees replaced expressions that have become unreachable since the last
+ * jc_registry_publish. */
+JC_API jc_status jc_registry_collect(jc_registry *registry);
+
+/* A reader is used by one thread at a time; each thread that evaluates
+ * attaches its own. Up to 128 readers per registry. */
+JC_API jc_status jc_registry_attach(jc_registry *registry, jc_reader **out);
+
+JC_API void jc_registry_detach(jc_reader *reader);
+
+/* Looks `name` up. The result, and code from jc_function on it, stay valid
+ * until jc_reader_unlock, even if the name is republished meanwhile. Each
+ * lock must be followed by an unlock before the next; NULL if there is no
+ * such name (still to be unlocked). */
+JC_API const jc_expr *jc_reader_lock(jc_reader *reader, const char *name);
+
+JC_API void jc_reader_unlock(jc_reader *reader);
+
+JC_API const char *jc_strerror(jc_status status);
+
+/* Message of the last failed jc_compile, jc_eval_files or replicated
+ * jc_eval_batch_parallel on the calling thread. */
+JC_API const char *jc_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
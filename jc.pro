@@ -0,0 +1,20 @@
+TEMPLATE = lib
+TARGET = jc
+
+CONFIG -= qt
+CONFIG += c++11
+
+DEFINES += JC_BUILD_SHARED
+unix: DEFINES += _FILE_OFFSET_BITS=64
+
+INCLUDEPATH += ../compiler/compiler
+LIBS += -L../compiler/compiler/release -lcompiler
+
+HEADERS += \
+    jit_calc.h \
+    jc.h \
+    jc_async.h
+
+SOURCES += \
+    jc.cpp \
+    jc_registry.cpp
@@ -0,0 +1,210 @@
+#ifndef JC_ASYNC_H
+#define JC_ASYNC_H
+
+#include "jc.h"
+
+#if defined(__cplusplus) && defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <utility>
+
+// C++20 coroutine interface to jc_job. Nothing here owns the job; free it
+// with jc_job_free once the coroutine is done with it.
+
+namespace jc {
+
+// Runs a job a chunk at a time, suspending after each one:
+//
+//     jc::Chunks chunks = jc::chunks(job, 4096);
+//
+//     while (chunks.next()) {
+//         report(chunks.progress());
+//         co_await loop.yield();
+//     }
+//
+//     if (chunks.status() == JC_ERROR_CANCELLED) ...
+class Chunks {
+public:
+    struct promise_type {
+        size_t progress = 0;
+        jc_status status = JC_OK;
+
+        Chunks get_return_object() {
+            return Chunks(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_always final_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_always yield_value(size_t progress) noexcept {
+            this->progress = progress;
+            return {};
+        }
+
+        void return_value(jc_status status) noexcept {
+            this->status = status;
+        }
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+
+    Chunks(Chunks &&other) noexcept
+        : handle(std::exchange(other.handle, nullptr)) {
+    }
+
+    Chunks &operator=(Chunks other) noexcept {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+
+    ~Chunks() {
+        if (handle)
+            handle.destroy();
+    }
+
+    // Evaluates the next chunk. False once the job is finished, cancelled
+    // or failed.
+    bool next() {
+        if (!handle.done())
+            handle.resume();
+
+        return !handle.done();
+    }
+
+    size_t progress() const {
+        return handle.promise().progress;
+    }
+
+    // Outcome of the job once next() returned false.
+    jc_status status() const {
+        return handle.promise().status;
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Chunks(std::coroutine_handle<promise_type> handle)
+        : handle(handle) {
+    }
+};
+
+// Chunks of up to `rows` rows (0 for no limit), each cut short after
+// `seconds` (0 for no limit).
+inline Chunks chunks(jc_job *job, size_t rows, double seconds = 0) {
+    while (true) {
+        jc_status status = jc_job_run(job, rows, seconds);
+
+        if (status != JC_OK || jc_job_finished(job))
+            co_return status;
+
+        co_yield jc_job_progress(job);
+    }
+}
+
+// An awaitable, lazily started coroutine returning a jc_status.
+class Task {
+public:
+    struct promise_type {
+        jc_status status = JC_OK;
+        std::coroutine_handle<> continuation;
+
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        // Resumes whoever awaited the task.
+        auto final_suspend() noexcept {
+            struct Resume {
+                bool await_ready() noexcept {
+                    return false;
+                }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                    return handle.promise().continuation ? handle.promise().continuation : std::noop_coroutine();
+                }
+
+                void await_resume() noexcept {
+                }
+            };
+
+            return Resume {};
+        }
+
+        void return_value(jc_status status) noexcept {
+            this->status = status;
+        }
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+
+    Task(Task &&other) noexcept
+        : handle(std::exchange(other.handle, nullptr)) {
+    }
+
+    Task &operator=(Task other) noexcept {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+
+    ~Task() {
+        if (handle)
+            handle.destroy();
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+
+    jc_status await_resume() const noexcept {
+        return handle.promise().status;
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Task(std::coroutine_handle<promise_type> handle)
+        : handle(handle) {
+    }
+};
+
+// Evaluates the whole job and co_awaits yield() between chunks, which is
+// where the event loop gets to run other work:
+//
+//     jc_status status = co_await jc::evaluate(job, 4096, 0.002, [&] { return loop.yield(); });
+template <class Yield>
+Task evaluate(jc_job *job, size_t rows, double seconds, Yield yield) {
+    while (true) {
+        jc_status status = jc_job_run(job, rows, seconds);
+
+        if (status != JC_OK || jc_job_finished(job))
+            co_return status;
+
+        co_await yield();
+    }
+}
+
+}
+
+#endif
+
+#endif
@@ -0,0 +1,211 @@
+#include "jc.h"
+
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+// Epoch-based reclamation. A reader publishes the global epoch in its slot
+// before it loads the table and clears the slot when it is done. A writer
+// swaps in a new table, then advances the epoch; whatever it replaced is
+// retired with the epoch from before the advance. Any reader that can
+// still hold it entered no later than that, so it is freed once every
+// active slot shows a later epoch.
+
+namespace {
+// Sorted by name and looked up with strcmp, so a read doesn't allocate.
+typedef std::vector<std::pair<std::string, jc_expr *>> Table;
+
+bool before(const Table::value_type &entry, const char *name) {
+    return strcmp(entry.first.c_str(), name) < 0;
+}
+
+struct Retired {
+    unsigned long long epoch;
+    const Table *table;
+    jc_expr *expr;
+};
+
+// Cache line sized, so readers on different cores don't share lines.
+struct alignas(64) Slot {
+    std::atomic<bool> claimed;
+    std::atomic<unsigned long long> epoch; // 0 while outside a critical section
+};
+
+const int slotCount = 128;
+}
+
+struct jc_reader {
+    jc_registry *registry;
+    Slot *slot;
+};
+
+struct jc_registry {
+    std::atomic<const Table *> table;
+    std::atomic<unsigned long long> epoch;
+    Slot slots[slotCount];
+    jc_reader readers[slotCount];
+
+    std::mutex writer;
+    std::vector<Retired> retired;
+
+    jc_registry()
+        : table(new Table)
+        , epoch(1) {
+        for (int i = 0; i < slotCount; i++) {
+            slots[i].claimed = false;
+            slots[i].epoch = 0;
+            readers[i] = jc_reader { this, &slots[i] };
+        }
+    }
+
+    ~jc_registry() {
+        for (const Retired &r : retired) {
+            delete r.table;
+            jc_free(r.expr);
+        }
+
+        for (const Table::value_type &entry : *table.load())
+            jc_free(entry.second);
+
+        delete table.load();
+    }
+
+    // Frees what no reader can reach any more. Called with `writer` held.
+    void reclaim() {
+        unsigned long long oldest = ~0ull;
+
+        for (const Slot &slot : slots) {
+            unsigned long long e = slot.epoch.load();
+
+            if (e && e < oldest)
+                oldest = e;
+        }
+
+        std::vector<Retired> pending;
+
+        for (const Retired &r : retired)
+            if (r.epoch < oldest) {
+                delete r.table;
+                jc_free(r.expr);
+            } else
+                pending.push_back(r);
+
+        retired.swap(pending);
+    }
+};
+
+jc_registry *jc_registry_create(void) {
+    return new (std::nothrow) jc_registry;
+}
+
+void jc_registry_destroy(jc_registry *registry) {
+    delete registry;
+}
+
+jc_status jc_registry_publish(jc_registry *registry, const char *name, jc_expr *e) {
+    if (!registry || !name) {
+        jc_free(e);
+        return JC_ERROR_INVALID_ARGUMENT;
+    }
+
+    std::lock_guard<std::mutex> lock(registry->writer);
+
+    const Table *old = registry->table.load();
+    Table::const_iterator at = std::lower_bound(old->begin(), old->end(), name, before);
+    bool found = at != old->end() && at->first == name;
+
+    // An expression already in the table, or retired and not yet freed, is
+    // owned here already; taking it again would free it twice.
+    if (e && !(found && at->second == e)) {
+        for (const Table::value_type &entry : *old)
+            if (entry.second == e)
+                return JC_ERROR_INVALID_ARGUMENT;
+
+        for (const Retired &r : registry->retired)
+            if (r.expr == e)
+                return JC_ERROR_INVALID_ARGUMENT;
+    }
+
+    try {
+        std::unique_ptr<Table> table(new Table(*old));
+
+        Table::iterator i = table->begin() + (at - old->begin());
+        jc_expr *replaced = found && i->second != e ? i->second : nullptr;
+
+        if (e && found)
+            i->second = e;
+        else if (e)
+            table->insert(i, std::make_pair(std::string(name), e));
+        else if (found)
+            table->erase(i);
+
+        registry->retired.reserve(registry->retired.size() + 1);
+        registry->table.store(table.release());
+        registry->retired.push_back(Retired { registry->epoch.fetch_add(1), old, replaced });
+    } catch (const std::bad_alloc &) {
+        jc_free(e);
+        return JC_ERROR_NO_MEMORY;
+    }
+
+    registry->reclaim();
+
+    return JC_OK;
+}
+
+jc_status jc_registry_collect(jc_registry *registry) {
+    if (!registry)
+        return JC_ERROR_INVALID_ARGUMENT;
+
+    std::lock_guard<std::mutex> lock(registry->writer);
+    registry->reclaim();
+
+    return JC_OK;
+}
+
+jc_status jc_registry_attach(jc_registry *registry, jc_reader **out) {
+    if (!registry || !out)
+        return JC_ERROR_INVALID_ARGUMENT;
+
+    for (int i = 0; i < slotCount; i++) {
+        bool expected = false;
+
+        if (registry->slots[i].claimed.compare_exchange_strong(expected, true)) {
+            *out = &registry->readers[i];
+            return JC_OK;
+        }
+    }
+
+    return JC_ERROR_NO_MEMORY;
+}
+
+void jc_registry_detach(jc_reader *reader) {
+    if (!reader)
+        return;
+
+    reader->slot->epoch.store(0);
+    reader->slot->claimed.store(false);
+}
+
+const jc_expr *jc_reader_lock(jc_reader *reader, const char *name) {
+    if (!reader || !name)
+        return nullptr;
+
+    jc_registry *registry = reader->registry;
+
+    reader->slot->epoch.store(registry->epoch.load());
+
+    const Table *table = registry->table.load();
+    Table::const_iterator i = std::lower_bound(table->begin(), table->end(), name, before);
+
+    return i != table->end() && i->first == name ? i->second : nullptr;
+}
+
+void jc_reader_unlock(jc_reader *reader) {
+    if (reader)
+        reader->slot->epoch.store(0, std::memory_order_release);
+}
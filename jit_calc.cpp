@@ -1,515 +1,327 @@
 #include <iostream>
-#include <cmath>
-#include <vector>
+#include <iomanip>
 #include <string>
-#include <exception>
 #include <memory>
-#include <ctime>
 #include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
 
-#include "compiler.h"
-
-typedef unsigned char byte;
-
-struct Function {
-    std::vector<byte> code;
-    int stackSize;
-};
-
-class VM {
-    double *stack = nullptr;
-    size_t stackSize;
-    byte *code;
-
-public:
-    enum ByteCode {
-        Push,
-        Add,
-        Sub,
-        Mul,
-        Div,
-        Pow,
-        Ret
-    };
-
-    void allocate(size_t size) {
-        delete stack;
+#include "jit_calc.h"
 
-        stack = new double[size];
-        stackSize = size;
-    }
-
-    void setCode(byte *code) {
-        this->code = code;
-    }
+// Parses a decimal number in [begin, end). Up to 19 significant digits and
+// a power of ten within 22 are converted exactly with one multiply or
+// divide; anything else, including nan and inf, goes through strtod. An
+// empty field is NaN.
+static double parseNumber(const char *begin, const char *end) {
+    static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
 
-    double run() {
-        byte *ip = code;
-        double *sp = stack + stackSize;
-
-        while (true)
-            switch (*(ip++)) {
-            case Push:
-                *(--sp) = *reinterpret_cast<const double *>(ip);
-                ip += sizeof(double);
-                break;
-
-            case Add:
-                *(sp + 1) += *sp;
-                sp++;
-                break;
-
-            case Sub:
-                *(sp + 1) -= *sp;
-                sp++;
-                break;
-
-            case Mul:
-                *(sp + 1) *= *sp;
-                sp++;
-                break;
-
-            case Div:
-                *(sp + 1) /= *sp;
-                sp++;
-                break;
-
-            case Pow:
-                *(sp + 1) = pow(*(sp + 1), *sp);
-                sp++;
-                break;
+    while (begin < end && (*begin == ' ' || *begin == '"'))
+        begin++;
 
-            case Ret:
-                return *sp;
-
-            default:
-                throw std::runtime_error("invalid byte code");
-            }
+    while (end > begin && (end[-1] == ' ' || end[-1] == '"'))
+        end--;
 
+    if (begin == end)
         return NAN;
-    }
-
-    x86::Function compile(const Function &f) {
-        const byte *ip = f.code.data();
-        int stackSize = f.stackSize;
-
-        x86::Compiler c;
-
-        c.push(x86::EBP);
-        c.mov(x86::ESP, x86::EBP);
-        c.sub(c.abs("stackSize"), x86::ESP);
-
-        int sp = 0;
-
-        std::vector<double> data;
 
-        while (true)
-            switch (*(ip++)) {
-            case Push:
-                if (ip > f.code.data() + 1)
-                    c.fstpl(c.ref(-sp, x86::EBP));
-
-                sp += 8;
-
-                c.fldl(c.ref(c.abs("data") + data.size() * sizeof(double)));
-                data.push_back(*reinterpret_cast<const double *>(ip));
-
-                ip += sizeof(double);
-                break;
-
-            case Add:
-                c.faddl(c.ref(-(sp -= 8), x86::EBP));
-                break;
-
-            case Sub:
-                c.fsubrl(c.ref(-(sp -= 8), x86::EBP));
-                break;
-
-            case Mul:
-                c.fmull(c.ref(-(sp -= 8), x86::EBP));
-                break;
-
-            case Div:
-                c.fdivrl(c.ref(-(sp -= 8), x86::EBP));
-                break;
-
-            case Pow:
-                c.fldl(c.ref(-(sp -= 8), x86::EBP));
-                c.fstpl(c.ref(x86::ESP));
-                c.fstpl(c.ref(8, x86::ESP));
-                c.call(c.rel("pow"));
-
-                stackSize = std::max(stackSize, static_cast<int>(sp + 16));
-                break;
-
-            case Ret: {
-                c.leave();
-                c.ret();
-
-                for (const double &constant : data)
-                    c.constant(constant);
-
-                const ByteArray &code = c.getCode();
+    const char *p = begin;
+    bool negative = *p == '-';
+
+    if (*p == '-' || *p == '+')
+        p++;
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+
+    for (; p < end && isdigit(static_cast<unsigned char>(*p)); p++, any = true)
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+        } else
+            exponent++;
+
+    if (p < end && *p == '.')
+        for (p++; p < end && isdigit(static_cast<unsigned char>(*p)); p++, any = true)
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+                exponent--;
+            }
 
-                c.relocate("data", reinterpret_cast<int>(code.data() + code.size() - data.size() * sizeof(double)));
-                c.relocate("stackSize", stackSize - 8);
-                c.relocate("pow", reinterpret_cast<int>(pow));
+    if (any && p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool negativeExponent = q < end && *q == '-';
 
-                c.writeOBJ().write("a.o");
-                system("objdump -d a.o");
-                std::cout << "\n";
+        if (q < end && (*q == '-' || *q == '+'))
+            q++;
 
-                return c.compileFunction();
-            }
+        int e = 0;
 
-            default:
-                throw std::runtime_error("invalid byte code");
-            }
+        for (; q < end && isdigit(static_cast<unsigned char>(*q)) && e < 10000; q++)
+            e = e * 10 + (*q - '0');
 
-        return x86::Function();
+        if (q > p + 1 && isdigit(static_cast<unsigned char>(q[-1]))) {
+            exponent += negativeExponent ? -e : e;
+            p = q;
+        }
     }
-};
 
-class Compiler;
+    if (any && p == end && digits < 19 && mantissa < (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+        double value = static_cast<double>(mantissa);
+        value = exponent < 0 ? value / powers[-exponent] : value * powers[exponent];
 
-class Node {
-public:
-    virtual ~Node() {
+        return negative ? -value : value;
     }
 
-    virtual double eval() = 0;
-    virtual void compile(Compiler *c) = 0;
-};
-
-class Compiler {
-    std::vector<byte> code;
-    int sp, stackSize;
-
-public:
-    Function compile(std::shared_ptr<Node> tree) {
-        code.clear();
+    std::string text(begin, end);
+    char *last;
+    double value = strtod(text.c_str(), &last);
 
-        sp = 0;
-        stackSize = 0;
-
-        tree->compile(this);
-        gen(VM::Ret);
+    return *last == '\0' ? value : NAN;
+}
 
-        return { code, stackSize };
-    }
+// Splits [begin, end) at the delimiter into fields. A delimiter between
+// double quotes belongs to its field; the quotes are left in it.
+static void split(const char *begin, const char *end, char delimiter, std::vector<std::pair<const char *, const char *>> &fields) {
+    fields.clear();
 
-    void gen(VM::ByteCode value) {
-        code.push_back(value);
-    }
+    bool quoted = false;
 
-    void gen(double value) {
-        code.insert(code.end(), sizeof(value), 0);
-        *reinterpret_cast<double *>(code.data() + code.size() - sizeof(value)) = value;
-    }
+    for (const char *p = begin;; p++)
+        if (p < end && *p == '"')
+            quoted = !quoted;
+        else if (p == end || (*p == delimiter && !quoted)) {
+            fields.push_back(std::make_pair(begin, p));
 
-    void push() {
-        sp += 8;
-        stackSize = std::max(stackSize, sp);
-    }
+            if (p == end)
+                break;
 
-    void pop() {
-        sp -= 8;
-    }
-};
+            begin = p + 1;
+        }
+}
 
-class ValueNode : public Node {
-    double value;
+// jit_calc [-single] [-fast] [--] <expression> [file]
+//
+// Evaluates the expression for every row of a CSV or TSV file (standard
+// input without a file or with "-") and prints one result per line. The
+// header names the columns, which become the variables; the delimiter is a
+// tab if the header has one and a comma otherwise. Input is read and
+// output written in large blocks, so the file is never held in memory.
+static int stream(int argc, char **argv) {
+    Precision precision = Double;
+    bool fastMath = false;
+    int arg = 1;
+
+    // Options end at the first argument that isn't one, so an expression
+    // may start with a minus; "--" ends them explicitly.
+    for (; arg < argc; arg++)
+        if (!strcmp(argv[arg], "-single"))
+            precision = Single;
+        else if (!strcmp(argv[arg], "-fast"))
+            fastMath = true;
+        else {
+            arg += !strcmp(argv[arg], "--");
+            break;
+        }
 
-public:
-    ValueNode(double value)
-        : value(value) {
+    if (arg == argc || argc - arg > 2) {
+        fprintf(stderr, "usage: %s [-single] [-fast] [--] <expression> [file]\n", argv[0]);
+        return 2;
     }
 
-    double eval() {
-        return value;
-    }
+    const char *expr = argv[arg];
+    FILE *input = arg + 1 < argc && strcmp(argv[arg + 1], "-") ? fopen(argv[arg + 1], "rb") : stdin;
 
-    void compile(Compiler *c) {
-        c->gen(VM::Push);
-        c->gen(value);
-        c->push();
+    if (!input) {
+        fprintf(stderr, "error: can't open '%s'\n", argv[arg + 1]);
+        return 1;
     }
-};
 
-class BinaryNode : public Node {
-protected:
-    Node *left, *right;
+    // Closes a file given on the command line on every return.
+    std::unique_ptr<FILE, int (*)(FILE *)> file(input != stdin ? input : nullptr, fclose);
 
-    BinaryNode(Node *left, Node *right)
-        : left(left)
-        , right(right) {
-    }
+    const size_t blockSize = 1 << 20;
 
-    ~BinaryNode() {
-        delete left;
-        delete right;
-    }
-};
+    std::vector<char> buffer(blockSize);
+    size_t begin = 0, end = 0;
+    bool eof = false;
+    long line = 0;
 
-class PlusNode : public BinaryNode {
-public:
-    PlusNode(Node *left, Node *right)
-        : BinaryNode(left, right) {
-    }
+    // Next line without its terminator, refilling the buffer as needed.
+    auto next = [&](const char *&first, const char *&last) -> bool {
+        while (true) {
+            char *newline = static_cast<char *>(memchr(buffer.data() + begin, '\n', end - begin));
 
-    double eval() {
-        return left->eval() + right->eval();
-    }
+            if (newline || (eof && begin < end)) {
+                first = buffer.data() + begin;
+                last = newline ? newline : buffer.data() + end;
+                begin = last - buffer.data() + (newline != nullptr);
 
-    void compile(Compiler *c) {
-        left->compile(c);
-        right->compile(c);
+                if (last > first && last[-1] == '\r')
+                    last--;
 
-        c->gen(VM::Add);
-        c->pop();
-    }
-};
+                line++;
+                return true;
+            }
 
-class MinusNode : public BinaryNode {
-public:
-    MinusNode(Node *left, Node *right)
-        : BinaryNode(left, right) {
-    }
+            if (eof)
+                return false;
 
-    double eval() {
-        return left->eval() - right->eval();
-    }
+            std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
 
-    void compile(Compiler *c) {
-        left->compile(c);
-        right->compile(c);
+            if (end == buffer.size())
+                buffer.resize(buffer.size() * 2);
 
-        c->gen(VM::Sub);
-        c->pop();
-    }
-};
+            end += fread(buffer.data() + end, 1, buffer.size() - end, input);
+            eof = feof(input) || ferror(input);
+        }
+    };
 
-class MultiplyNode : public BinaryNode {
-public:
-    MultiplyNode(Node *left, Node *right)
-        : BinaryNode(left, right) {
-    }
+    const char *first, *last;
 
-    double eval() {
-        return left->eval() * right->eval();
+    if (!next(first, last)) {
+        fprintf(stderr, "error: no header\n");
+        return 1;
     }
 
-    void compile(Compiler *c) {
-        left->compile(c);
-        right->compile(c);
+    char delimiter = memchr(first, '\t', last - first) ? '\t' : ',';
+    std::vector<std::pair<const char *, const char *>> fields;
+    std::vector<std::string> columns;
 
-        c->gen(VM::Mul);
-        c->pop();
-    }
-};
+    split(first, last, delimiter, fields);
 
-class DivideNode : public BinaryNode {
-public:
-    DivideNode(Node *left, Node *right)
-        : BinaryNode(left, right) {
+    for (const std::pair<const char *, const char *> &field : fields) {
+        std::string name(field.first, field.second);
+        name.erase(0, name.find_first_not_of(" \""));
+        name.erase(name.find_last_not_of(" \"") + 1);
+        columns.push_back(name);
     }
 
-    double eval() {
-        return left->eval() / right->eval();
-    }
+    Lexer lexer;
+    Parser parser;
+    Optimizer optimizer;
+    Compiler compiler;
+    VM vm;
 
-    void compile(Compiler *c) {
-        left->compile(c);
-        right->compile(c);
+    Function func;
+    x86::Function fObj;
 
-        c->gen(VM::Div);
-        c->pop();
-    }
-};
+    try {
+        parser.setVariables(columns);
+        optimizer.setPrecision(precision);
+        optimizer.setFastMath(fastMath);
+        compiler.setPrecision(precision);
 
-class PowerNode : public BinaryNode {
-public:
-    PowerNode(Node *left, Node *right)
-        : BinaryNode(left, right) {
-    }
+        IR ir(optimizer.optimize(parser.parse(lexer.lex(expr))));
+        ir.setPrecision(precision);
+        ir.setFastMath(fastMath);
+        ir.optimize();
 
-    double eval() {
-        return pow(left->eval(), right->eval());
+        func = compiler.compile(ir);
+        fObj = vm.compile(func, VM::Array, true);
+    } catch (const std::exception &e) {
+        fprintf(stderr, "error: %s\n", e.what());
+        return 1;
     }
 
-    void compile(Compiler *c) {
-        left->compile(c);
-        right->compile(c);
+    double (*f)(const double *) = reinterpret_cast<double (*)(const double *)>(fObj.getCode());
+    float (*fSingle)(const float *) = reinterpret_cast<float (*)(const float *)>(fObj.getCode());
 
-        c->gen(VM::Pow);
-        c->pop();
-    }
-};
+    // Rows are parsed a block at a time into row-major argument arrays and
+    // then run through the code back to back.
+    const size_t rowsPerBlock = 4096;
 
-struct Token {
-    char id;
-    std::string text;
-};
+    std::vector<double> args(rowsPerBlock * columns.size());
+    std::vector<float> argsSingle(precision == Single ? args.size() : 0);
+    std::string output;
 
-class Lexer {
-public:
-    std::vector<Token> lex(const std::string &expr) {
-        size_t pos = 0;
-        std::vector<Token> tokens;
+    output.reserve(blockSize + 64);
 
-        while (true) {
-            while (isspace(expr[pos]))
-                pos++;
+    bool more = true, failed = false;
 
-            if (expr[pos] == '\0') {
-                tokens.push_back({ 'e', "" });
-                break;
-            } else if (isdigit(expr[pos])) {
-                std::string text;
+    while (more) {
+        size_t rows = 0;
 
-                while (isdigit(expr[pos]))
-                    text += expr[pos++];
+        while (rows < rowsPerBlock && (more = next(first, last))) {
+            if (first == last)
+                continue;
 
-                if (expr[pos] == '.')
-                    do
-                        text += expr[pos++];
-                    while (isdigit(expr[pos]));
+            split(first, last, delimiter, fields);
 
-                tokens.push_back({ 'n', text });
-            } else if (isalpha(expr[pos])) {
-                std::string text;
+            if (fields.size() != columns.size()) {
+                fprintf(stderr, "error: line %ld has %d fields instead of %d\n", line, static_cast<int>(fields.size()), static_cast<int>(columns.size()));
+                failed = true;
+                more = false;
+                break;
+            }
 
-                while (isalnum(expr[pos]))
-                    text += expr[pos++];
+            for (size_t i = 0; i < fields.size(); i++)
+                args[rows * columns.size() + i] = parseNumber(fields[i].first, fields[i].second);
 
-                tokens.push_back({ 'u', text });
-            } else
-                tokens.push_back({ (std::string("+-*/^()").find(expr[pos]) != std::string::npos ? expr[pos] : 'u'), std::string() + expr[pos++] });
+            rows++;
         }
 
-        return tokens;
-    }
-};
-
-class Parser {
-    std::vector<Token> tokens;
-    std::vector<Token>::const_iterator token;
-
-public:
-    std::shared_ptr<Node> parse(const std::vector<Token> &tokens) {
-        this->tokens = tokens;
-        token = this->tokens.begin();
-
-        Node *n = addSub();
-
-        if (!check('e'))
-            throw std::runtime_error("there's an excess part of expression");
+        char text[32];
 
-        return std::shared_ptr<Node>(n);
-    }
-
-private:
-    void getToken() {
-        ++token;
-    }
+        for (size_t row = 0; row < rows; row++) {
+            int length;
 
-    bool check(char id) {
-        return token->id == id;
-    }
+            if (precision == Single) {
+                for (size_t i = 0; i < columns.size(); i++)
+                    argsSingle[row * columns.size() + i] = static_cast<float>(args[row * columns.size() + i]);
 
-    bool accept(char id) {
-        if (check(id)) {
-            getToken();
-            return true;
-        }
+                length = snprintf(text, sizeof(text), "%.9g\n", fSingle(argsSingle.data() + row * columns.size()));
+            } else
+                length = snprintf(text, sizeof(text), "%.17g\n", f(args.data() + row * columns.size()));
 
-        return false;
-    }
+            output.append(text, length);
 
-    Node *addSub() {
-        Node *n = mulDiv();
+            if (output.size() >= blockSize) {
+                if (fwrite(output.data(), 1, output.size(), stdout) != output.size()) {
+                    fprintf(stderr, "error: write failed\n");
+                    return 1;
+                }
 
-        while (true) {
-            if (accept('+'))
-                n = new PlusNode(n, mulDiv());
-            else if (accept('-'))
-                n = new MinusNode(n, mulDiv());
-            else
-                break;
+                output.clear();
+            }
         }
-
-        return n;
     }
 
-    Node *mulDiv() {
-        Node *n = power();
-
-        while (true) {
-            if (accept('*'))
-                n = new MultiplyNode(n, power());
-            else if (accept('/'))
-                n = new DivideNode(n, power());
-            else
-                break;
-        }
-
-        return n;
+    // Rows before a bad line are still written.
+    if (fwrite(output.data(), 1, output.size(), stdout) != output.size() || fflush(stdout) != 0 || ferror(stdout)) {
+        fprintf(stderr, "error: write failed\n");
+        return 1;
     }
 
-    Node *power() {
-        Node *n = unary();
-
-        while (true) {
-            if (accept('^'))
-                n = new PowerNode(n, unary());
-            else
-                break;
-        }
-
-        return n;
+    // A read error ends the input like its end does.
+    if (ferror(input)) {
+        fprintf(stderr, "error: read failed\n");
+        return 1;
     }
 
-    Node *unary() {
-        Node *n = nullptr;
-
-        if (accept('+'))
-            n = new PlusNode(new ValueNode(0), term());
-        else if (accept('-'))
-            n = new MinusNode(new ValueNode(0), term());
-        else
-            n = term();
-
-        return n;
-    }
+    return failed ? 1 : 0;
+}
 
-    Node *term() {
-        Node *n = nullptr;
-
-        if (check('n')) {
-            n = new ValueNode(std::stod(token->text));
-            getToken();
-        } else if (accept('(')) {
-            n = addSub();
-
-            if (!accept(')'))
-                throw std::runtime_error("unmatched parentheses");
-        } else if (check('u'))
-            throw std::runtime_error("unknown token '" + token->text + "'");
-        else if (check('e'))
-            throw std::runtime_error("unexpected end of expression");
-        else
-            throw std::runtime_error("unexpected token '" + token->text + "'");
-
-        return n;
-    }
-};
+int main(int argc, char **argv) {
+    if (argc > 1)
+        return stream(argc, argv);
 
-int main() {
     Lexer lexer;
     Parser parser;
+    Optimizer optimizer;
     Compiler compiler;
     VM vm;
 
+    Precision precision = Double;
+    bool fastMath = false;
+
+    vm.setDump(true);
+
     std::cout << std::setprecision(16);
 
     while (true) {
@@ -525,16 +337,24 @@ int main() {
         else if (str == "cls") {
             system("cls");
             continue;
+        } else if (str == "single" || str == "double") {
+            precision = str == "single" ? Single : Double;
+            continue;
+        } else if (str == "fast" || str == "strict") {
+            fastMath = str == "fast";
+            continue;
         } else if (str == "test") {
             const char *expr = "2 * (3 + 1 / 2) - 6 + 2 * (3 + 1 / 2) - 6 + 2 * (3 + 1 / 2) - 6 + 2 * (3 + 1 / 2) - 6 + 2 * (3 + 1 / 2) - 6";
 
             std::shared_ptr<Node> tree = parser.parse(lexer.lex(expr));
+
+            compiler.setPrecision(Double);
+
             Function func = compiler.compile(tree);
-            x86::Function fObj = vm.compile(func);
+            x86::Function fObj = vm.compile(func, VM::Scalars);
             double (*f)() = reinterpret_cast<double (*)()>(fObj.getCode());
 
-            vm.allocate(func.stackSize);
-            vm.setCode(func.code.data());
+            vm.setFunction(func);
 
             const int N = 1000000;
             double sum;
@@ -544,7 +364,7 @@ int main() {
             begin = std::chrono::high_resolution_clock::now();
             sum = 0;
             for (int i = 0; i < N; i++)
-                sum += tree->eval();
+                sum += tree->eval(nullptr);
             end = std::chrono::high_resolution_clock::now();
 
             std::cout << "tree:     sum=" << sum << " time=" << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << " msec\n";
@@ -552,7 +372,7 @@ int main() {
             begin = std::chrono::high_resolution_clock::now();
             sum = 0;
             for (int i = 0; i < N; i++)
-                sum += vm.run();
+                sum += vm.run(nullptr);
             end = std::chrono::high_resolution_clock::now();
 
             std::cout << "bytecode: sum=" << sum << " time=" << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << " msec\n";
@@ -566,8 +386,23 @@ int main() {
             std::cout << "x86 code: sum=" << sum << " time=" << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << " msec\n";
         } else {
             try {
-                x86::Function f = vm.compile(compiler.compile(parser.parse(lexer.lex(str))));
-                std::cout << reinterpret_cast<double (*)()>(f.getCode())() << "\n";
+                optimizer.setPrecision(precision);
+                optimizer.setFastMath(fastMath);
+                compiler.setPrecision(precision);
+
+                IR ir(optimizer.optimize(parser.parse(lexer.lex(str))));
+                ir.setPrecision(precision);
+                ir.setFastMath(fastMath);
+                ir.optimize();
+
+                x86::Function f = vm.compile(compiler.compile(ir), VM::Scalars);
+
+                if (precision == Single)
+                    std::cout << reinterpret_cast<float (*)()>(f.getCode())();
+                else
+                    std::cout << reinterpret_cast<double (*)()>(f.getCode())();
+
+                std::cout << (precision == Single ? " [single" : " [double") << (fastMath ? ", fast-math]" : ", strict]") << "\n";
             } catch (const std::exception &e) {
                 std::cout << "error: " << e.what() << "\n";
             }
@@ -0,0 +1,3355 @@
+#pragma once
+
+#include <iostream>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <exception>
+#include <stdexcept>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <map>
+#include <tuple>
+#include <queue>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+
+#include "compiler.h"
+
+typedef unsigned char byte;
+
+// Operands follow their opcode in the byte code, so they may be unaligned.
+inline int immediate(const byte *ip) {
+    int value;
+    memcpy(&value, ip, sizeof(value));
+    return value;
+}
+
+// Element type an expression is compiled for. Single keeps constants,
+// arguments and intermediates in float.
+enum Precision {
+    Double,
+    Single
+};
+
+// Neumaier's variant of Kahan summation: the rounding error of every add
+// is accumulated separately and added back once at the end.
+template <class T>
+struct CompensatedSum {
+    T sum = 0, compensation = 0;
+
+    void add(T value) {
+        T t = sum + value;
+
+        if (std::fabs(sum) >= std::fabs(value))
+            compensation += (sum - t) + value;
+        else
+            compensation += (value - t) + sum;
+
+        sum = t;
+    }
+
+    T result() const {
+        return sum + compensation;
+    }
+};
+
+// A column of a batch. `validity`, if not null, is a bitmap with the least
+// significant bit first, as in Arrow, whose bit `offset` belongs to the
+// first row; a clear bit marks a null.
+template <class T>
+struct Column {
+    const T *values;
+    const byte *validity;
+    size_t offset;
+};
+
+// The `count` (at most 64) validity bits from bit `offset` on as a word,
+// reading only the bytes they lie in.
+inline uint64_t validityWord(const byte *bitmap, size_t offset, size_t count) {
+    const byte *p = bitmap + (offset >> 3);
+    size_t shift = offset & 7, bytes = (shift + count + 7) >> 3;
+    uint64_t word = 0;
+
+    for (size_t i = 0; i < bytes && i < 8; i++)
+        word |= static_cast<uint64_t>(p[i]) << (i * 8);
+
+    word >>= shift;
+
+    if (bytes > 8)
+        word |= static_cast<uint64_t>(p[8]) << (64 - shift);
+
+    return count < 64 ? word & ((static_cast<uint64_t>(1) << count) - 1) : word;
+}
+
+// Where a constant pool entry came from: the index of the number among the
+// literals of the source, or -1 for constants the optimizer derived, and
+// whether a unary minus was folded into it, making the entry 0 - literal.
+struct Literal {
+    int index;
+    bool negated;
+};
+
+// Whether zero + literal, or zero - literal if `subtract`, can become the
+// literal itself, for every value it may be rebound to. A negated literal
+// stands for 0 - v, which is never -0, so -0 - v and 0 - (0 - v) do not
+// fold; 0 + v does not either, since it is +0 for v = -0.
+inline bool foldsIntoLiteral(bool subtract, bool negativeZero, const Literal &literal) {
+    return subtract ? !negativeZero && !literal.negated : negativeZero || literal.negated;
+}
+
+// An instruction of register code: register `target` gets the opcode
+// applied to registers operands[0..2]. Push and Load take a pool entry and
+// a variable instead; Sum adds the operands[1] registers listed in
+// Function::terms from operands[0].
+struct Instruction {
+    int op;
+    int target;
+    int operands[3];
+};
+
+struct Function {
+    std::vector<byte> code;
+    int stackSize;
+    Precision precision;
+    std::vector<double> constants;
+    std::vector<Literal> literals;
+    std::vector<int> parameters;
+    int variables; // arguments the code may load
+
+    // Register form of the same computation, present when compiled from an
+    // IR. The last instruction writes the result.
+    std::vector<Instruction> instructions;
+    std::vector<int> terms;
+
+    // Pool entries computed from other entries, for subexpressions of
+    // constants and parameters only: each instruction sets
+    // constants[target] from the entries it names, so the code reads the
+    // value instead of computing it per row.
+    std::vector<Instruction> derived;
+
+    // Gives the index-th literal of the source a new value without
+    // recompiling. Returns false if the optimizer folded it away.
+    bool rebind(int index, double value) {
+        bool found = false;
+
+        for (size_t i = 0; i < literals.size(); i++)
+            if (literals[i].index == index) {
+                constants[i] = literals[i].negated ? 0 - value : value;
+
+                if (precision == Single)
+                    constants[i] = static_cast<float>(constants[i]);
+
+                found = true;
+            }
+
+        if (found)
+            derive();
+
+        return found;
+    }
+
+    // Sets the value the index-th parameter has in the pool until the next
+    // call. Returns false if the expression doesn't use it.
+    bool setParameter(int index, double value) {
+        bool found = false;
+
+        for (size_t i = 0; i < parameters.size(); i++)
+            if (parameters[i] == index) {
+                constants[i] = precision == Single ? static_cast<float>(value) : value;
+                found = true;
+            }
+
+        if (found)
+            derive();
+
+        return found;
+    }
+
+    // Recomputes the derived pool entries.
+    void derive();
+
+private:
+    template <class T>
+    void derive();
+};
+
+class VM {
+    double *stack = nullptr;
+    size_t stackSize;
+    byte *code;
+    const double *constants;
+    const Function *function = nullptr;
+    bool dump = false;
+    bool verified = false;
+
+public:
+    enum ByteCode {
+        Push,
+        Load,
+        Fetch,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        Pow,
+        SubR,
+        DivR,
+        MulAdd,
+        MulAddR,
+        Sum,
+        Ret
+    };
+
+    // Calling convention of the generated code (cdecl), with float in place
+    // of double for Single precision functions:
+    //   Array   - double (*)(const double *args)
+    //   Scalars - double (*)(double x0, double x1, ...), variables are read
+    //             straight from the caller's argument area
+    enum Signature {
+        Array,
+        Scalars
+    };
+
+    ~VM() {
+        delete[] stack;
+    }
+
+    void allocate(size_t size) {
+        delete[] stack;
+
+        stack = new double[size];
+        stackSize = size;
+    }
+
+    void setCode(byte *code) {
+        this->code = code;
+        verified = false;
+    }
+
+    // Verifies f, sizes the stack to what it needs and sets up its code and
+    // constants. run() then dispatches without checking anything; f must
+    // outlive the runs.
+    void setFunction(const Function &f) {
+        allocate(verify(f));
+
+        code = const_cast<byte *>(f.code.data());
+        constants = f.constants.data();
+        function = &f;
+        verified = true;
+    }
+
+    void setConstants(const double *constants) {
+        this->constants = constants;
+    }
+
+    void setDump(bool dump) {
+        this->dump = dump;
+    }
+
+    double run(const double *args) {
+        return verified ? exec<false>(args) : exec<true>(args);
+    }
+
+    float runSingle(const float *args) {
+        return verified ? exec<false>(args) : exec<true>(args);
+    }
+
+    // Runs the register code of the function given to setFunction.
+    double runRegisters(const double *args) {
+        return execRegisters(args);
+    }
+
+    float runRegistersSingle(const float *args) {
+        return execRegisters(args);
+    }
+
+    // Checks that f is safe to run without checks: every opcode is known,
+    // every operand lies inside the code, the pool and f.variables, the
+    // stack never underflows, Ret ends the code with a value on the stack
+    // and f.stackSize covers the deepest point. Register code must only
+    // read registers it wrote before. Returns how many entries the stack or
+    // the registers need, whichever is more, or throws std::runtime_error
+    // naming the first problem.
+    static int verify(const Function &f) {
+        const byte *ip = f.code.data(), *end = ip + f.code.size();
+        int sp = 0, depth = 0;
+
+        if (f.literals.size() != f.constants.size() || f.parameters.size() != f.constants.size())
+            throw std::runtime_error("invalid byte code: pool tables differ in size");
+
+        for (const Instruction &i : f.derived) {
+            auto entry = [&](int index) {
+                if (index < 0 || static_cast<size_t>(index) >= f.constants.size())
+                    throw std::runtime_error("invalid byte code: derived entry out of range");
+            };
+
+            entry(i.target);
+
+            switch (i.op) {
+            case MulAdd:
+                entry(i.operands[2]);
+                entry(i.operands[0]);
+                entry(i.operands[1]);
+                break;
+
+            case Add:
+            case Sub:
+            case Mul:
+            case Div:
+            case Pow:
+                entry(i.operands[0]);
+                entry(i.operands[1]);
+                break;
+
+            case Sum:
+                if (i.operands[0] < 0 || i.operands[1] < 1 || static_cast<size_t>(i.operands[0]) > f.terms.size() || f.terms.size() - i.operands[0] < static_cast<size_t>(i.operands[1]))
+                    throw std::runtime_error("invalid byte code: terms out of range");
+
+                for (int j = 0; j < i.operands[1]; j++)
+                    entry(f.terms[i.operands[0] + j]);
+                break;
+
+            default:
+                throw std::runtime_error("invalid byte code: unknown derived opcode");
+            }
+        }
+
+        auto operand = [&]() {
+            if (static_cast<size_t>(end - ip) < sizeof(int))
+                throw std::runtime_error("invalid byte code: truncated operand");
+
+            int value = immediate(ip);
+            ip += sizeof(int);
+
+            return value;
+        };
+
+        auto pop = [&](int count) {
+            if (sp < count)
+                throw std::runtime_error("invalid byte code: stack underflow");
+
+            sp -= count;
+        };
+
+        while (true) {
+            if (ip == end)
+                throw std::runtime_error("invalid byte code: missing Ret");
+
+            switch (*(ip++)) {
+            case Push: {
+                int index = operand();
+
+                if (index < 0 || static_cast<size_t>(index) >= f.constants.size())
+                    throw std::runtime_error("invalid byte code: constant out of range");
+
+                depth = std::max(depth, ++sp);
+                break;
+            }
+
+            case Load: {
+                int index = operand();
+
+                if (index < 0 || index >= f.variables)
+                    throw std::runtime_error("invalid byte code: variable out of range");
+
+                depth = std::max(depth, ++sp);
+                break;
+            }
+
+            case Fetch: {
+                int index = operand();
+
+                if (index < 0 || index >= sp)
+                    throw std::runtime_error("invalid byte code: stack entry out of range");
+
+                depth = std::max(depth, ++sp);
+                break;
+            }
+
+            case Add:
+            case Sub:
+            case Mul:
+            case Div:
+            case Pow:
+            case SubR:
+            case DivR:
+                pop(2);
+                sp++;
+                break;
+
+            case MulAdd:
+            case MulAddR:
+                pop(3);
+                sp++;
+                break;
+
+            case Sum: {
+                int count = operand();
+
+                if (count < 1)
+                    throw std::runtime_error("invalid byte code: empty Sum");
+
+                pop(count);
+                sp++;
+                break;
+            }
+
+            case Ret:
+                if (sp < 1)
+                    throw std::runtime_error("invalid byte code: stack underflow");
+
+                if (ip != end)
+                    throw std::runtime_error("invalid byte code: code after Ret");
+
+                if (f.stackSize < depth * static_cast<int>(f.precision == Single ? sizeof(float) : sizeof(double)))
+                    throw std::runtime_error("invalid byte code: stack size too small");
+
+                return std::max(depth, verifyRegisters(f));
+
+            default:
+                throw std::runtime_error("invalid byte code: unknown opcode");
+            }
+        }
+    }
+
+    // Evaluates `rows` rows column-wise, 64 at a time, and returns how many
+    // results are null. A row is null if any column the code loads is null
+    // in it; validity is the AND of those columns' bitmaps, a word per
+    // block, and blocks with no valid row are skipped outright. `validity`
+    // receives the result bitmap, (rows + 7) / 8 bytes, unless it is null;
+    // null results are 0.
+    size_t runBatch(const Column<double> *columns, size_t rows, double *out, byte *validity) {
+        return execBatch(columns, rows, out, validity);
+    }
+
+    size_t runBatchSingle(const Column<float> *columns, size_t rows, float *out, byte *validity) {
+        return execBatch(columns, rows, out, validity);
+    }
+
+private:
+    // Unless `checked`, the code must have passed verify().
+    template <bool checked, class T>
+    T exec(const T *args) {
+        byte *ip = code;
+        T *sp = reinterpret_cast<T *>(stack) + stackSize;
+
+        while (true)
+            switch (*(ip++)) {
+            case Push:
+                *(--sp) = static_cast<T>(constants[immediate(ip)]);
+                ip += sizeof(int);
+                break;
+
+            case Load:
+                *(--sp) = args[immediate(ip)];
+                ip += sizeof(int);
+                break;
+
+            case Fetch:
+                *(--sp) = *(reinterpret_cast<T *>(stack) + stackSize - 1 - immediate(ip));
+                ip += sizeof(int);
+                break;
+
+            case Add:
+                *(sp + 1) += *sp;
+                sp++;
+                break;
+
+            case Sub:
+                *(sp + 1) -= *sp;
+                sp++;
+                break;
+
+            case Mul:
+                *(sp + 1) *= *sp;
+                sp++;
+                break;
+
+            case Div:
+                *(sp + 1) /= *sp;
+                sp++;
+                break;
+
+            case Pow:
+                *(sp + 1) = static_cast<T>(pow(*(sp + 1), *sp));
+                sp++;
+                break;
+
+            case SubR:
+                *(sp + 1) = *sp - *(sp + 1);
+                sp++;
+                break;
+
+            case DivR:
+                *(sp + 1) = *sp / *(sp + 1);
+                sp++;
+                break;
+
+            case MulAdd:
+                *(sp + 2) = static_cast<T>(fma(*(sp + 1), *sp, *(sp + 2)));
+                sp += 2;
+                break;
+
+            case MulAddR:
+                *(sp + 2) = static_cast<T>(fma(*(sp + 2), *(sp + 1), *sp));
+                sp += 2;
+                break;
+
+            case Sum: {
+                int count = immediate(ip);
+                ip += sizeof(int);
+
+                CompensatedSum<T> sum;
+
+                for (int i = count - 1; i >= 0; i--)
+                    sum.add(sp[i]);
+
+                sp += count - 1;
+                *sp = sum.result();
+                break;
+            }
+
+            case Ret:
+                return *sp;
+
+            default:
+                if (checked)
+                    throw std::runtime_error("invalid byte code");
+
+#ifdef _MSC_VER
+                __assume(0);
+#else
+                __builtin_unreachable();
+#endif
+            }
+
+        return NAN;
+    }
+
+    // Registers the register code of f needs; see verify().
+    static int verifyRegisters(const Function &f) {
+        int registers = 0;
+
+        for (const Instruction &i : f.instructions)
+            registers = std::max(registers, i.target + 1);
+
+        if (registers > static_cast<int>(f.instructions.size()))
+            throw std::runtime_error("invalid register code: register out of range");
+
+        std::vector<bool> written(registers);
+
+        auto read = [&](int r) {
+            if (r < 0 || r >= registers || !written[r])
+                throw std::runtime_error("invalid register code: register read before it is written");
+        };
+
+        for (const Instruction &i : f.instructions) {
+            if (i.target < 0)
+                throw std::runtime_error("invalid register code: register out of range");
+
+            switch (i.op) {
+            case Push:
+                if (i.operands[0] < 0 || static_cast<size_t>(i.operands[0]) >= f.constants.size())
+                    throw std::runtime_error("invalid register code: constant out of range");
+                break;
+
+            case Load:
+                if (i.operands[0] < 0 || i.operands[0] >= f.variables)
+                    throw std::runtime_error("invalid register code: variable out of range");
+                break;
+
+            case Add:
+            case Sub:
+            case Mul:
+            case Div:
+            case Pow:
+                read(i.operands[0]);
+                read(i.operands[1]);
+                break;
+
+            case MulAdd:
+                read(i.operands[0]);
+                read(i.operands[1]);
+                read(i.operands[2]);
+                break;
+
+            case Sum:
+                if (i.operands[0] < 0 || i.operands[1] < 1 || static_cast<size_t>(i.operands[0]) > f.terms.size() || f.terms.size() - i.operands[0] < static_cast<size_t>(i.operands[1]))
+                    throw std::runtime_error("invalid register code: terms out of range");
+
+                for (int j = 0; j < i.operands[1]; j++)
+                    read(f.terms[i.operands[0] + j]);
+                break;
+
+            default:
+                throw std::runtime_error("invalid register code: unknown opcode");
+            }
+
+            written[i.target] = true;
+        }
+
+        return registers;
+    }
+
+    // Registers live in the stack buffer; setFunction sized it for them.
+    template <class T>
+    T execRegisters(const T *args) {
+        if (!function || function->instructions.empty())
+            throw std::runtime_error("no register code");
+
+        T *r = reinterpret_cast<T *>(stack);
+
+        for (const Instruction &i : function->instructions)
+            switch (i.op) {
+            case Push:
+                r[i.target] = static_cast<T>(constants[i.operands[0]]);
+                break;
+
+            case Load:
+                r[i.target] = args[i.operands[0]];
+                break;
+
+            case Add:
+                r[i.target] = r[i.operands[0]] + r[i.operands[1]];
+                break;
+
+            case Sub:
+                r[i.target] = r[i.operands[0]] - r[i.operands[1]];
+                break;
+
+            case Mul:
+                r[i.target] = r[i.operands[0]] * r[i.operands[1]];
+                break;
+
+            case Div:
+                r[i.target] = r[i.operands[0]] / r[i.operands[1]];
+                break;
+
+            case Pow:
+                r[i.target] = static_cast<T>(pow(r[i.operands[0]], r[i.operands[1]]));
+                break;
+
+            case MulAdd:
+                r[i.target] = static_cast<T>(fma(r[i.operands[0]], r[i.operands[1]], r[i.operands[2]]));
+                break;
+
+            case Sum: {
+                CompensatedSum<T> sum;
+
+                for (int j = 0; j < i.operands[1]; j++)
+                    sum.add(r[function->terms[i.operands[0] + j]]);
+
+                r[i.target] = sum.result();
+                break;
+            }
+            }
+
+        return r[function->instructions.back().target];
+    }
+
+    // Variables the code loads and the deepest its stack gets, in entries.
+    void scan(std::vector<int> &loads, int &depth) const {
+        int sp = 0;
+        depth = 0;
+
+        for (byte *ip = code;;)
+            switch (*(ip++)) {
+            case Push:
+                depth = std::max(depth, ++sp);
+                ip += sizeof(int);
+                break;
+
+            case Load:
+                depth = std::max(depth, ++sp);
+
+                if (std::find(loads.begin(), loads.end(), immediate(ip)) == loads.end())
+                    loads.push_back(immediate(ip));
+
+                ip += sizeof(int);
+                break;
+
+            case Fetch:
+                depth = std::max(depth, ++sp);
+                ip += sizeof(int);
+                break;
+
+            case MulAdd:
+            case MulAddR:
+                sp -= 2;
+                break;
+
+            case Sum:
+                sp -= immediate(ip) - 1;
+                ip += sizeof(int);
+                break;
+
+            case Ret:
+                return;
+
+            case Add:
+            case Sub:
+            case Mul:
+            case Div:
+            case Pow:
+            case SubR:
+            case DivR:
+                sp--;
+                break;
+
+            default:
+                throw std::runtime_error("invalid byte code");
+            }
+    }
+
+    // Each stack entry is a block of 64 lanes, one per row, so an opcode is
+    // dispatched once per block rather than once per row.
+    template <class T>
+    size_t execBatch(const Column<T> *columns, size_t rows, T *out, byte *validity) {
+        const size_t lanes = 64;
+
+        std::vector<int> loads;
+        int depth;
+        scan(loads, depth);
+
+        std::vector<T> blocks(depth * lanes);
+        size_t nulls = 0;
+
+        for (size_t block = 0; block < rows; block += lanes) {
+            size_t n = std::min(lanes, rows - block);
+            uint64_t mask = n < 64 ? (static_cast<uint64_t>(1) << n) - 1 : ~static_cast<uint64_t>(0);
+
+            for (int index : loads)
+                if (columns[index].validity)
+                    mask &= validityWord(columns[index].validity, columns[index].offset + block, n);
+
+            if (validity)
+                for (size_t i = 0; i < (n + 7) / 8; i++)
+                    validity[block / 8 + i] = static_cast<byte>(mask >> (i * 8));
+
+            if (!mask) {
+                std::fill(out + block, out + block + n, T(0));
+                nulls += n;
+                continue;
+            }
+
+            byte *ip = code;
+            T *sp = blocks.data() + blocks.size();
+
+            for (bool done = false; !done;)
+                switch (*(ip++)) {
+                case Push:
+                    sp -= lanes;
+                    std::fill(sp, sp + n, static_cast<T>(constants[immediate(ip)]));
+                    ip += sizeof(int);
+                    break;
+
+                case Load:
+                    sp -= lanes;
+                    std::copy(columns[immediate(ip)].values + block, columns[immediate(ip)].values + block + n, sp);
+                    ip += sizeof(int);
+                    break;
+
+                case Fetch: {
+                    const T *entry = blocks.data() + blocks.size() - (immediate(ip) + 1) * lanes;
+
+                    sp -= lanes;
+                    std::copy(entry, entry + n, sp);
+                    ip += sizeof(int);
+                    break;
+                }
+
+                case Add:
+                    for (size_t i = 0; i < n; i++)
+                        sp[lanes + i] += sp[i];
+                    sp += lanes;
+                    break;
+
+                case Sub:
+                    for (size_t i = 0; i < n; i++)
+                        sp[lanes + i] -= sp[i];
+                    sp += lanes;
+                    break;
+
+                case Mul:
+                    for (size_t i = 0; i < n; i++)
+                        sp[lanes + i] *= sp[i];
+                    sp += lanes;
+                    break;
+
+                case Div:
+                    for (size_t i = 0; i < n; i++)
+                        sp[lanes + i] /= sp[i];
+                    sp += lanes;
+                    break;
+
+                case Pow:
+                    for (size_t i = 0; i < n; i++)
+                        sp[lanes + i] = static_cast<T>(pow(sp[lanes + i], sp[i]));
+                    sp += lanes;
+                    break;
+
+                case SubR:
+                    for (size_t i = 0; i < n; i++)
+                        sp[lanes + i] = sp[i] - sp[lanes + i];
+                    sp += lanes;
+                    break;
+
+                case DivR:
+                    for (size_t i = 0; i < n; i++)
+                        sp[lanes + i] = sp[i] / sp[lanes + i];
+                    sp += lanes;
+                    break;
+
+                case MulAdd:
+                    for (size_t i = 0; i < n; i++)
+                        sp[2 * lanes + i] = static_cast<T>(fma(sp[lanes + i], sp[i], sp[2 * lanes + i]));
+                    sp += 2 * lanes;
+                    break;
+
+                case MulAddR:
+                    for (size_t i = 0; i < n; i++)
+                        sp[2 * lanes + i] = static_cast<T>(fma(sp[2 * lanes + i], sp[lanes + i], sp[i]));
+                    sp += 2 * lanes;
+                    break;
+
+                case Sum: {
+                    int count = immediate(ip);
+                    ip += sizeof(int);
+
+                    for (size_t i = 0; i < n; i++) {
+                        CompensatedSum<T> sum;
+
+                        for (int j = count - 1; j >= 0; j--)
+                            sum.add(sp[j * lanes + i]);
+
+                        sp[(count - 1) * lanes + i] = sum.result();
+                    }
+
+                    sp += (count - 1) * lanes;
+                    break;
+                }
+
+                case Ret:
+                    for (size_t i = 0; i < n; i++)
+                        if (mask >> i & 1)
+                            out[block + i] = sp[i];
+                        else {
+                            out[block + i] = 0;
+                            nulls++;
+                        }
+
+                    done = true;
+                    break;
+
+                default:
+                    throw std::runtime_error("invalid byte code");
+                }
+        }
+
+        return nulls;
+    }
+
+public:
+    // With a shared pool the code reads its constants from f.constants
+    // instead of a private copy, so Function::rebind and setParameter take
+    // effect without recompiling; f must then outlive the code. A private
+    // copy keeps the parameter values f had at compile time.
+    x86::Function compile(const Function &f, Signature signature = Array, bool sharedPool = false) {
+        verify(f);
+
+        const byte *ip = f.code.data();
+        int stackSize = f.stackSize;
+
+        bool single = f.precision == Single;
+        int slot = single ? sizeof(float) : sizeof(double);
+
+        x86::Compiler c;
+
+        c.push(x86::EBP);
+        c.mov(x86::ESP, x86::EBP);
+        c.sub(c.abs("stackSize"), x86::ESP);
+
+        int sp = 0;
+
+        // Lowest offset from EBP the code touches, checked against the
+        // frame once its size is known.
+        int lowest = 0;
+
+        auto frame = [&](int offset) {
+            lowest = std::min(lowest, offset);
+            return c.ref(offset, x86::EBP);
+        };
+
+        while (true)
+            switch (*(ip++)) {
+            case Push:
+                if (ip > f.code.data() + 1)
+                    single ? c.fstps(frame(-sp)) : c.fstpl(frame(-sp));
+
+                sp += slot;
+
+                c.fldl(c.ref(c.abs("data") + immediate(ip) * sizeof(double)));
+
+                ip += sizeof(int);
+                break;
+
+            case Load:
+                if (ip > f.code.data() + 1)
+                    single ? c.fstps(frame(-sp)) : c.fstpl(frame(-sp));
+
+                sp += slot;
+
+                if (signature == Scalars)
+                    single ? c.flds(frame(8 + immediate(ip) * slot)) : c.fldl(frame(8 + immediate(ip) * slot));
+                else {
+                    c.mov(frame(8), x86::EAX);
+                    single ? c.flds(c.ref(immediate(ip) * slot, x86::EAX)) : c.fldl(c.ref(immediate(ip) * slot, x86::EAX));
+                }
+
+                ip += sizeof(int);
+                break;
+
+            // Entries under the top live in their spill slots, the k-th from
+            // the bottom at -(k + 1) slots.
+            case Fetch:
+                single ? c.fstps(frame(-sp)) : c.fstpl(frame(-sp));
+                sp += slot;
+
+                single ? c.flds(frame(-(immediate(ip) + 1) * slot)) : c.fldl(frame(-(immediate(ip) + 1) * slot));
+
+                ip += sizeof(int);
+                break;
+
+            case Add:
+                single ? c.fadds(frame(-(sp -= slot))) : c.faddl(frame(-(sp -= slot)));
+                break;
+
+            case Sub:
+                single ? c.fsubrs(frame(-(sp -= slot))) : c.fsubrl(frame(-(sp -= slot)));
+                break;
+
+            case Mul:
+                single ? c.fmuls(frame(-(sp -= slot))) : c.fmull(frame(-(sp -= slot)));
+                break;
+
+            case Div:
+                single ? c.fdivrs(frame(-(sp -= slot))) : c.fdivrl(frame(-(sp -= slot)));
+                break;
+
+            // The right operand was computed first and spilled, the left one
+            // is in ST0.
+            case SubR:
+                single ? c.fsubs(frame(-(sp -= slot))) : c.fsubl(frame(-(sp -= slot)));
+                break;
+
+            case DivR:
+                single ? c.fdivs(frame(-(sp -= slot))) : c.fdivl(frame(-(sp -= slot)));
+                break;
+
+            case Pow:
+                single ? c.flds(frame(-(sp -= slot))) : c.fldl(frame(-(sp -= slot)));
+                c.fstpl(c.ref(x86::ESP));
+                c.fstpl(c.ref(8, x86::ESP));
+                c.call(c.rel("pow"));
+
+                stackSize = std::max(stackSize, static_cast<int>(sp + 16));
+                break;
+
+            // Neumaier summation with the branch replaced by Knuth's TwoSum,
+            // which yields the same exact error term. Every step is stored to
+            // a spill slot so it rounds to the target precision like the VM.
+            case Sum: {
+                int count = immediate(ip);
+                ip += sizeof(int);
+
+                if (count < 2)
+                    break;
+
+                auto load = [&](int offset) {
+                    single ? c.flds(frame(offset)) : c.fldl(frame(offset));
+                };
+
+                auto store = [&](int offset) {
+                    single ? c.fstps(frame(offset)) : c.fstpl(frame(offset));
+                };
+
+                auto add = [&](int offset) {
+                    single ? c.fadds(frame(offset)) : c.faddl(frame(offset));
+                };
+
+                auto subtract = [&](int offset) {
+                    single ? c.fsubs(frame(offset)) : c.fsubl(frame(offset));
+                };
+
+                // The last term joins the others in its spill slot; the
+                // running sum, the next sum, two temporaries and the
+                // compensation go in slots past the top.
+                store(-sp);
+
+                int sum = -(sp - (count - 1) * slot), next = -(sp + slot), b = -(sp + 2 * slot), t = -(sp + 3 * slot), compensation = -(sp + 4 * slot);
+
+                for (int i = 1; i < count; i++) {
+                    int term = -(sp - (count - 1 - i) * slot);
+
+                    load(sum), add(term), store(next); // next = sum + term
+                    load(next), subtract(sum), store(b); // b = next - sum
+                    load(next), subtract(b), store(t); // t = next - b
+                    load(sum), subtract(t), store(t); // t = sum - t
+                    load(term), subtract(b), store(b); // b = term - b
+                    load(t), add(b), store(i == 1 ? compensation : t); // the error, exactly
+
+                    if (i > 1)
+                        load(compensation), add(t), store(compensation);
+
+                    std::swap(sum, next);
+                }
+
+                load(sum), add(compensation), store(t);
+                load(t);
+
+                stackSize = std::max(stackSize, static_cast<int>(sp + 5 * slot));
+                sp -= (count - 1) * slot;
+                break;
+            }
+
+            // x87 has no fused multiply-add; the product stays in extended
+            // precision until the add, which is the closest it gets.
+            case MulAdd:
+                single ? c.fmuls(frame(-(sp -= slot))) : c.fmull(frame(-(sp -= slot)));
+                single ? c.fadds(frame(-(sp -= slot))) : c.faddl(frame(-(sp -= slot)));
+                break;
+
+            // The addend is in ST0 and goes to its spill slot, so the
+            // factors can be multiplied into ST0 and the addend added back.
+            case MulAddR:
+                stackSize = std::max(stackSize, static_cast<int>(sp + slot));
+
+                single ? c.fstps(frame(-sp)) : c.fstpl(frame(-sp));
+                single ? c.flds(frame(-(sp - 2 * slot))) : c.fldl(frame(-(sp - 2 * slot)));
+                single ? c.fmuls(frame(-(sp - slot))) : c.fmull(frame(-(sp - slot)));
+                single ? c.fadds(frame(-sp)) : c.faddl(frame(-sp));
+
+                sp -= 2 * slot;
+                break;
+
+            case Ret: {
+                if (-lowest > stackSize - slot)
+                    throw std::runtime_error("compiled code reaches past its frame");
+
+                c.leave();
+                c.ret();
+
+                if (sharedPool)
+                    c.relocate("data", reinterpret_cast<int>(f.constants.data()));
+                else {
+                    for (const double &constant : f.constants)
+                        c.constant(constant);
+
+                    const ByteArray &code = c.getCode();
+
+                    c.relocate("data", reinterpret_cast<int>(code.data() + code.size() - f.constants.size() * sizeof(double)));
+                }
+
+                c.relocate("stackSize", stackSize - slot);
+                c.relocate("pow", reinterpret_cast<int>(pow));
+
+                if (dump) {
+                    c.writeOBJ().write("a.o");
+                    system("objdump -d a.o");
+                    std::cout << "\n";
+                }
+
+                return c.compileFunction();
+            }
+
+            default:
+                throw std::runtime_error("invalid byte code");
+            }
+
+        return x86::Function();
+    }
+};
+
+inline void Function::derive() {
+    precision == Single ? derive<float>() : derive<double>();
+}
+
+// Rounded to T at every step, as the VM would compute it.
+template <class T>
+void Function::derive() {
+    for (const Instruction &i : derived) {
+        T value;
+
+        if (i.op == VM::Sum) {
+            CompensatedSum<T> sum;
+
+            for (int j = 0; j < i.operands[1]; j++)
+                sum.add(static_cast<T>(constants[terms[i.operands[0] + j]]));
+
+            value = sum.result();
+        } else {
+            T a = static_cast<T>(constants[i.operands[0]]), b = static_cast<T>(constants[i.operands[1]]);
+
+            switch (i.op) {
+            case VM::Add:
+                value = a + b;
+                break;
+            case VM::Sub:
+                value = a - b;
+                break;
+            case VM::Mul:
+                value = a * b;
+                break;
+            case VM::Div:
+                value = a / b;
+                break;
+            case VM::Pow:
+                value = static_cast<T>(pow(a, b));
+                break;
+            default:
+                value = static_cast<T>(fma(a, b, static_cast<T>(constants[i.operands[2]])));
+                break;
+            }
+        }
+
+        constants[i.target] = value;
+    }
+}
+
+class Compiler;
+class IR;
+
+class Node {
+protected:
+    std::vector<std::shared_ptr<Node>> children;
+
+public:
+    // Subtrees no one else holds are unlinked onto a worklist before they
+    // are released, so destroying a deep tree doesn't recurse per level.
+    virtual ~Node() {
+        std::vector<std::shared_ptr<Node>> pending;
+        pending.swap(children);
+
+        while (!pending.empty()) {
+            std::shared_ptr<Node> n = std::move(pending.back());
+            pending.pop_back();
+
+            if (n.use_count() == 1)
+                for (std::shared_ptr<Node> &child : n->children)
+                    pending.push_back(std::move(child));
+        }
+    }
+
+    size_t arity() const {
+        return children.size();
+    }
+
+    const std::shared_ptr<Node> &child(size_t i) const {
+        return children[i];
+    }
+
+    // A node of the same kind over new children.
+    virtual std::shared_ptr<Node> rebuild(const std::vector<std::shared_ptr<Node>> &operands) const = 0;
+
+    // Value of the node given the values of its children, the variables of
+    // the row and the parameters.
+    virtual double apply(const double *operands, const double *args, const double *params) const = 0;
+
+    // Code of the node itself, emitted after the code of its children.
+    virtual void emit(Compiler *c) const = 0;
+
+    // Whether a node of two children can have its right child compiled
+    // first, and its code for that order.
+    virtual bool reversible() const {
+        return false;
+    }
+
+    virtual void emitReversed(Compiler *) const {
+    }
+
+    // The children in the order compile() puts them on the stack, given
+    // the entries each needs. A reversible node takes the needier child
+    // first; otherwise they go left to right. Nodes that reorder in other
+    // ways get emitReversed() whenever the first child is not first.
+    virtual std::vector<size_t> order(const std::vector<int> &needs) const {
+        std::vector<size_t> order(children.size());
+
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = reversible() && needs[1] > needs[0] ? order.size() - 1 - i : i;
+
+        return order;
+    }
+
+    // Post-order walk with an explicit stack, so evaluation depth is not
+    // bounded by the C++ stack.
+    double eval(const double *args, const double *params = nullptr) const {
+        static thread_local std::vector<std::pair<const Node *, size_t>> stack;
+        static thread_local std::vector<double> values;
+
+        stack.assign(1, std::make_pair(this, 0));
+        values.clear();
+
+        while (!stack.empty()) {
+            const Node *n = stack.back().first;
+            size_t i = stack.back().second;
+
+            if (i < n->children.size()) {
+                stack.back().second++;
+                stack.push_back(std::make_pair(n->children[i].get(), 0));
+            } else {
+                size_t count = n->children.size();
+                double value = n->apply(values.data() + values.size() - count, args, params);
+
+                values.resize(values.size() - count);
+                values.push_back(value);
+                stack.pop_back();
+            }
+        }
+
+        return values.back();
+    }
+
+    // Children are compiled in the order order() picks, which keeps the
+    // deepest point of the stack as low as the tree allows.
+    void compile(Compiler *c) const {
+        std::unordered_map<const Node *, int> need = needs();
+
+        struct Frame {
+            const Node *node;
+            size_t next;
+            std::vector<size_t> order;
+        };
+
+        auto frame = [&](const Node *n) {
+            return Frame{ n, 0, n->order(n->needsOf(need)) };
+        };
+
+        std::vector<Frame> stack(1, frame(this));
+
+        while (!stack.empty()) {
+            Frame &f = stack.back();
+
+            if (f.next < f.order.size()) {
+                const Node *child = f.node->children[f.order[f.next++]].get();
+                stack.push_back(frame(child));
+            } else {
+                !f.order.empty() && f.order[0] != 0 ? f.node->emitReversed(c) : f.node->emit(c);
+                stack.pop_back();
+            }
+        }
+    }
+
+private:
+    std::vector<int> needsOf(std::unordered_map<const Node *, int> &need) const {
+        std::vector<int> needs;
+
+        for (const std::shared_ptr<Node> &child : children)
+            needs.push_back(need[child.get()]);
+
+        return needs;
+    }
+
+    // Ershov numbers: the stack entries each subtree needs when compiled
+    // the way compile() does it. The i-th child compiled needs i entries
+    // under it.
+    std::unordered_map<const Node *, int> needs() const {
+        std::unordered_map<const Node *, int> need;
+        std::vector<std::pair<const Node *, size_t>> stack(1, std::make_pair(this, 0));
+
+        while (!stack.empty()) {
+            const Node *n = stack.back().first;
+            size_t i = stack.back().second;
+
+            if (i < n->children.size()) {
+                stack.back().second++;
+
+                if (!need.count(n->children[i].get()))
+                    stack.push_back(std::make_pair(n->children[i].get(), 0));
+            } else {
+                int depth = 1;
+                std::vector<int> needs = n->needsOf(need);
+                std::vector<size_t> order = n->order(needs);
+
+                for (size_t j = 0; j < order.size(); j++)
+                    depth = std::max(depth, needs[order[j]] + static_cast<int>(j));
+
+                need[n] = depth;
+                stack.pop_back();
+            }
+        }
+
+        return need;
+    }
+};
+
+class Compiler {
+    std::vector<byte> code;
+    std::vector<double> constants;
+    std::vector<Literal> literals;
+    std::vector<int> parameters;
+    std::vector<Instruction> instructions;
+    std::vector<int> terms;
+    std::vector<Instruction> derived;
+    int sp, stackSize, variables;
+    Precision precision = Double;
+
+public:
+    void setPrecision(Precision precision) {
+        this->precision = precision;
+    }
+
+    Function compile(std::shared_ptr<Node> tree) {
+        start();
+        tree->compile(this);
+
+        return finish();
+    }
+
+    // Stack code and register code from an optimized IR.
+    Function compile(const IR &ir);
+
+    void gen(VM::ByteCode value) {
+        code.push_back(value);
+    }
+
+    // Adds an entry to the constant pool and returns its index.
+    int constant(double value, Literal literal) {
+        constants.push_back(precision == Single ? static_cast<float>(value) : value);
+        literals.push_back(literal);
+        parameters.push_back(-1);
+
+        return static_cast<int>(constants.size() - 1);
+    }
+
+    // Pool entry of the index-th parameter, shared by all its uses. It is
+    // NaN until Function::setParameter gives it a value.
+    int parameter(int index) {
+        std::vector<int>::const_iterator i = std::find(parameters.begin(), parameters.end(), index);
+
+        if (i != parameters.end())
+            return static_cast<int>(i - parameters.begin());
+
+        int entry = constant(NAN, { -1, false });
+        parameters[entry] = index;
+
+        return entry;
+    }
+
+    // Operand of a Load; the function takes at least index + 1 arguments.
+    int variable(int index) {
+        variables = std::max(variables, index + 1);
+        return index;
+    }
+
+    void gen(int value) {
+        code.insert(code.end(), sizeof(value), 0);
+        memcpy(code.data() + code.size() - sizeof(value), &value, sizeof(value));
+    }
+
+    void push() {
+        sp += slot();
+        stackSize = std::max(stackSize, sp);
+    }
+
+    void pop() {
+        sp -= slot();
+    }
+
+    void instruction(VM::ByteCode op, int target, int a, int b = 0, int c = 0) {
+        instructions.push_back({ op, target, { a, b, c } });
+    }
+
+    // Adds a pool entry computed from other entries; see Function::derived.
+    int derive(VM::ByteCode op, int a, int b = 0, int c = 0) {
+        int entry = constant(NAN, { -1, false });
+        derived.push_back({ op, entry, { a, b, c } });
+
+        return entry;
+    }
+
+    // Registers a Sum instruction adds; returns where they start in
+    // Function::terms.
+    int sum(const std::vector<int> &registers) {
+        terms.insert(terms.end(), registers.begin(), registers.end());
+        return static_cast<int>(terms.size() - registers.size());
+    }
+
+private:
+    void start() {
+        code.clear();
+        constants.clear();
+        literals.clear();
+        parameters.clear();
+        instructions.clear();
+        terms.clear();
+        derived.clear();
+
+        sp = 0;
+        stackSize = 0;
+        variables = 0;
+    }
+
+    Function finish() {
+        gen(VM::Ret);
+
+        Function f = { code, stackSize, precision, constants, literals, parameters, variables, instructions, terms, derived };
+        f.derive();
+
+        return f;
+    }
+
+    int slot() const {
+        return precision == Single ? sizeof(float) : sizeof(double);
+    }
+};
+
+class ValueNode : public Node {
+    double value;
+    Literal literal;
+
+public:
+    ValueNode(double value, Literal literal = { -1, false })
+        : value(value)
+        , literal(literal) {
+    }
+
+    double getValue() const {
+        return value;
+    }
+
+    const Literal &getLiteral() const {
+        return literal;
+    }
+
+    std::shared_ptr<Node> rebuild(const std::vector<std::shared_ptr<Node>> &) const {
+        return std::make_shared<ValueNode>(value, literal);
+    }
+
+    double apply(const double *, const double *, const double *) const {
+        return value;
+    }
+
+    void emit(Compiler *c) const {
+        c->gen(VM::Push);
+        c->gen(c->constant(value, literal));
+        c->push();
+    }
+};
+
+class VariableNode : public Node {
+    int index;
+
+public:
+    VariableNode(int index)
+        : index(index) {
+    }
+
+    int getIndex() const {
+        return index;
+    }
+
+    std::shared_ptr<Node> rebuild(const std::vector<std::shared_ptr<Node>> &) const {
+        return std::make_shared<VariableNode>(index);
+    }
+
+    double apply(const double *, const double *args, const double *) const {
+        return args[index];
+    }
+
+    void emit(Compiler *c) const {
+        c->gen(VM::Load);
+        c->gen(c->variable(index));
+        c->push();
+    }
+};
+
+// A value fixed for a whole batch of rows. Compiled code reads it from the
+// constant pool, where Function::setParameter puts it; Optimizer can fold
+// it in as a constant instead.
+class ParameterNode : public Node {
+    int index;
+
+public:
+    ParameterNode(int index)
+        : index(index) {
+    }
+
+    int getIndex() const {
+        return index;
+    }
+
+    std::shared_ptr<Node> rebuild(const std::vector<std::shared_ptr<Node>> &) const {
+        return std::make_shared<ParameterNode>(index);
+    }
+
+    double apply(const double *, const double *, const double *params) const {
+        return params[index];
+    }
+
+    void emit(Compiler *c) const {
+        c->gen(VM::Push);
+        c->gen(c->parameter(index));
+        c->push();
+    }
+};
+
+class BinaryNode : public Node {
+protected:
+    BinaryNode(std::shared_ptr<Node> left, std::shared_ptr<Node> right) {
+        children = { left, right };
+    }
+
+public:
+    const std::shared_ptr<Node> &getLeft() const {
+        return children[0];
+    }
+
+    const std::shared_ptr<Node> &getRight() const {
+        return children[1];
+    }
+
+    // Operator character, the same as the token it is parsed from.
+    virtual char op() const = 0;
+
+    // Goes through makeBinary; nodes for operators added to the parser's
+    // table override it.
+    std::shared_ptr<Node> rebuild(const std::vector<std::shared_ptr<Node>> &operands) const;
+};
+
+class PlusNode : public BinaryNode {
+public:
+    PlusNode(std::shared_ptr<Node> left, std::shared_ptr<Node> right)
+        : BinaryNode(left, right) {
+    }
+
+    char op() const {
+        return '+';
+    }
+
+    double apply(const double *operands, const double *, const double *) const {
+        return operands[0] + operands[1];
+    }
+
+    void emit(Compiler *c) const {
+        c->gen(VM::Add);
+        c->pop();
+    }
+
+    bool reversible() const {
+        return true;
+    }
+
+    void emitReversed(Compiler *c) const {
+        c->gen(VM::Add);
+        c->pop();
+    }
+};
+
+class MinusNode : public BinaryNode {
+public:
+    MinusNode(std::shared_ptr<Node> left, std::shared_ptr<Node> right)
+        : BinaryNode(left, right) {
+    }
+
+    char op() const {
+        return '-';
+    }
+
+    double apply(const double *operands, const double *, const double *) const {
+        return operands[0] - operands[1];
+    }
+
+    void emit(Compiler *c) const {
+        c->gen(VM::Sub);
+        c->pop();
+    }
+
+    bool reversible() const {
+        return true;
+    }
+
+    void emitReversed(Compiler *c) const {
+        c->gen(VM::SubR);
+        c->pop();
+    }
+};
+
+class MultiplyNode : public BinaryNode {
+public:
+    MultiplyNode(std::shared_ptr<Node> left, std::shared_ptr<Node> right)
+        : BinaryNode(left, right) {
+    }
+
+    char op() const {
+        return '*';
+    }
+
+    double apply(const double *operands, const double *, const double *) const {
+        return operands[0] * operands[1];
+    }
+
+    void emit(Compiler *c) const {
+        c->gen(VM::Mul);
+        c->pop();
+    }
+
+    bool reversible() const {
+        return true;
+    }
+
+    void emitReversed(Compiler *c) const {
+        c->gen(VM::Mul);
+        c->pop();
+    }
+};
+
+class DivideNode : public BinaryNode {
+public:
+    DivideNode(std::shared_ptr<Node> left, std::shared_ptr<Node> right)
+        : BinaryNode(left, right) {
+    }
+
+    char op() const {
+        return '/';
+    }
+
+    double apply(const double *operands, const double *, const double *) const {
+        return operands[0] / operands[1];
+    }
+
+    void emit(Compiler *c) const {
+        c->gen(VM::Div);
+        c->pop();
+    }
+
+    bool reversible() const {
+        return true;
+    }
+
+    void emitReversed(Compiler *c) const {
+        c->gen(VM::DivR);
+        c->pop();
+    }
+};
+
+class PowerNode : public BinaryNode {
+public:
+    PowerNode(std::shared_ptr<Node> left, std::shared_ptr<Node> right)
+        : BinaryNode(left, right) {
+    }
+
+    char op() const {
+        return '^';
+    }
+
+    double apply(const double *operands, const double *, const double *) const {
+        return pow(operands[0], operands[1]);
+    }
+
+    void emit(Compiler *c) const {
+        c->gen(VM::Pow);
+        c->pop();
+    }
+};
+
+// a * b + c, contracted by the optimizer in fast-math mode. The addend is
+// the first child. It is compiled first, so the JIT can finish with a
+// multiply and an add from the spill slots, unless compiling it last
+// needs less stack; the factors go needier first either way.
+class MultiplyAddNode : public Node {
+public:
+    MultiplyAddNode(std::shared_ptr<Node> a, std::shared_ptr<Node> b, std::shared_ptr<Node> addend) {
+        children = { addend, a, b };
+    }
+
+    const std::shared_ptr<Node> &getA() const {
+        return children[1];
+    }
+
+    const std::shared_ptr<Node> &getB() const {
+        return children[2];
+    }
+
+    const std::shared_ptr<Node> &getAddend() const {
+        return children[0];
+    }
+
+    std::shared_ptr<Node> rebuild(const std::vector<std::shared_ptr<Node>> &operands) const {
+        return std::make_shared<MultiplyAddNode>(operands[1], operands[2], operands[0]);
+    }
+
+    double apply(const double *operands, const double *, const double *) const {
+        return fma(operands[1], operands[2], operands[0]);
+    }
+
+    std::vector<size_t> order(const std::vector<int> &needs) const {
+        size_t first = needs[2] > needs[1] ? 2 : 1, second = 3 - first;
+
+        if (std::max(needs[first], std::max(needs[second] + 1, needs[0] + 2)) < std::max(needs[0], std::max(needs[first] + 1, needs[second] + 2)))
+            return { first, second, 0 };
+
+        return { 0, first, second };
+    }
+
+    void emit(Compiler *c) const {
+        c->gen(VM::MulAdd);
+        c->pop();
+        c->pop();
+    }
+
+    void emitReversed(Compiler *c) const {
+        c->gen(VM::MulAddR);
+        c->pop();
+        c->pop();
+    }
+};
+
+// Sum of three or more terms with compensated accumulation, built by the
+// optimizer from +/- chains. Subtracted terms are negated up front.
+class SumNode : public Node {
+public:
+    SumNode(const std::vector<std::shared_ptr<Node>> &terms) {
+        children = terms;
+    }
+
+    const std::vector<std::shared_ptr<Node>> &getTerms() const {
+        return children;
+    }
+
+    std::shared_ptr<Node> rebuild(const std::vector<std::shared_ptr<Node>> &operands) const {
+        return std::make_shared<SumNode>(operands);
+    }
+
+    double apply(const double *operands, const double *, const double *) const {
+        CompensatedSum<double> sum;
+
+        for (size_t i = 0; i < children.size(); i++)
+            sum.add(operands[i]);
+
+        return sum.result();
+    }
+
+    void emit(Compiler *c) const {
+        c->gen(VM::Sum);
+        c->gen(static_cast<int>(children.size()));
+
+        for (size_t i = 1; i < children.size(); i++)
+            c->pop();
+    }
+};
+
+inline std::shared_ptr<Node> makeBinary(char op, std::shared_ptr<Node> left, std::shared_ptr<Node> right) {
+    switch (op) {
+    case '+':
+        return std::make_shared<PlusNode>(left, right);
+    case '-':
+        return std::make_shared<MinusNode>(left, right);
+    case '*':
+        return std::make_shared<MultiplyNode>(left, right);
+    case '/':
+        return std::make_shared<DivideNode>(left, right);
+    case '^':
+        return std::make_shared<PowerNode>(left, right);
+    }
+
+    throw std::runtime_error(std::string("unknown operator '") + op + "'");
+}
+
+inline std::shared_ptr<Node> BinaryNode::rebuild(const std::vector<std::shared_ptr<Node>> &operands) const {
+    return makeBinary(op(), operands[0], operands[1]);
+}
+
+class Optimizer {
+    Precision precision = Double;
+    bool fastMath = false;
+    bool reassociation = false;
+    bool compensated = false;
+    bool folding = true;
+    std::vector<double> parameters;
+
+public:
+    void setPrecision(Precision precision) {
+        this->precision = precision;
+    }
+
+    // Allows results that differ from strict left-to-right evaluation:
+    // chains are reassociated. The rewrites of single operations are the
+    // IR's, under its own setFastMath.
+    void setFastMath(bool fastMath) {
+        this->fastMath = fastMath;
+    }
+
+    // Relaxed FP: rebuilds +/- and * and / chains as log-depth trees, which turns
+    // a serial dependency chain into independent operations and keeps deep
+    // chains from driving recursion in the later passes.
+    void setReassociation(bool reassociation) {
+        this->reassociation = reassociation;
+    }
+
+    // Sums of three or more terms use compensated (Neumaier) accumulation.
+    // Takes precedence over reassociation for +/- chains.
+    void setCompensated(bool compensated) {
+        this->compensated = compensated;
+    }
+
+    // Without folding every literal stays in the constant pool on its own
+    // and can be rebound after compilation.
+    void setFolding(bool folding) {
+        this->folding = folding;
+    }
+
+    // Specializes for the given parameter values: they replace the
+    // parameters as constants, so the IR folds them and expands x^n with a
+    // constant integer n like any literal. Empty leaves parameters to be
+    // read at run time.
+    void setParameters(const std::vector<double> &parameters) {
+        this->parameters = parameters;
+    }
+
+    std::shared_ptr<Node> optimize(const std::shared_ptr<Node> &tree) {
+        std::shared_ptr<Node> n = tree;
+
+        if (!parameters.empty())
+            n = transform(n, &Optimizer::childrenOf, &Optimizer::specialize);
+
+        if (compensated)
+            n = transform(n, &Optimizer::sumOperands, &Optimizer::compensate);
+
+        if (fastMath || reassociation)
+            n = transform(n, &Optimizer::chainOperands, &Optimizer::reassociate);
+
+        return n;
+    }
+
+private:
+    typedef void (Optimizer::*Expand)(const std::shared_ptr<Node> &, std::vector<std::shared_ptr<Node>> &);
+    typedef std::shared_ptr<Node> (Optimizer::*Build)(const std::shared_ptr<Node> &, const std::vector<std::shared_ptr<Node>> &);
+
+    double round(double value) const {
+        return precision == Single ? static_cast<float>(value) : value;
+    }
+
+    static double apply(char op, double left, double right) {
+        switch (op) {
+        case '+':
+            return left + right;
+        case '-':
+            return left - right;
+        case '*':
+            return left * right;
+        case '/':
+            return left / right;
+        case '^':
+            return pow(left, right);
+        }
+
+        return NAN;
+    }
+
+    static bool isValue(const std::shared_ptr<Node> &n) {
+        return dynamic_cast<ValueNode *>(n.get()) != nullptr;
+    }
+
+    static double valueOf(const std::shared_ptr<Node> &n) {
+        return static_cast<ValueNode *>(n.get())->getValue();
+    }
+
+    static char opOf(const std::shared_ptr<Node> &n) {
+        BinaryNode *binary = dynamic_cast<BinaryNode *>(n.get());
+        return binary ? binary->op() : '\0';
+    }
+
+    // Rewrites a tree bottom-up with an explicit stack. expand lists the
+    // subtrees a node is rebuilt from (usually its children), which are
+    // rewritten first; build then makes the node's replacement from them.
+    std::shared_ptr<Node> transform(const std::shared_ptr<Node> &tree, Expand expand, Build build) {
+        struct Frame {
+            std::shared_ptr<Node> node;
+            std::vector<std::shared_ptr<Node>> inputs;
+            size_t next;
+        };
+
+        std::vector<Frame> stack;
+        std::vector<std::shared_ptr<Node>> results;
+
+        stack.push_back(Frame{ tree, {}, 0 });
+        (this->*expand)(tree, stack.back().inputs);
+
+        while (!stack.empty()) {
+            Frame &frame = stack.back();
+
+            if (frame.next < frame.inputs.size()) {
+                std::shared_ptr<Node> input = frame.inputs[frame.next++];
+
+                stack.push_back(Frame{ input, {}, 0 });
+                (this->*expand)(input, stack.back().inputs);
+            } else {
+                std::vector<std::shared_ptr<Node>> inputs(results.end() - frame.inputs.size(), results.end());
+                results.resize(results.size() - frame.inputs.size());
+
+                results.push_back((this->*build)(frame.node, inputs));
+                stack.pop_back();
+            }
+        }
+
+        return results.back();
+    }
+
+    void childrenOf(const std::shared_ptr<Node> &n, std::vector<std::shared_ptr<Node>> &inputs) {
+        for (size_t i = 0; i < n->arity(); i++)
+            inputs.push_back(n->child(i));
+    }
+
+    // n over the given children, reusing n if none of them changed.
+    static std::shared_ptr<Node> replace(const std::shared_ptr<Node> &n, const std::vector<std::shared_ptr<Node>> &children) {
+        for (size_t i = 0; i < children.size(); i++)
+            if (children[i] != n->child(i))
+                return n->rebuild(children);
+
+        return n;
+    }
+
+    std::shared_ptr<Node> specialize(const std::shared_ptr<Node> &n, const std::vector<std::shared_ptr<Node>> &children) {
+        ParameterNode *parameter = dynamic_cast<ParameterNode *>(n.get());
+
+        if (!parameter)
+            return replace(n, children);
+
+        if (parameter->getIndex() >= static_cast<int>(parameters.size()))
+            throw std::invalid_argument("no value for parameter " + std::to_string(parameter->getIndex()));
+
+        return std::make_shared<ValueNode>(parameters[parameter->getIndex()]);
+    }
+
+    static bool isChain(char op) {
+        return op == '+' || op == '-' || op == '*' || op == '/';
+    }
+
+    void chainOperands(const std::shared_ptr<Node> &n, std::vector<std::shared_ptr<Node>> &inputs) {
+        char op = opOf(n);
+
+        if (!isChain(op)) {
+            childrenOf(n, inputs);
+            return;
+        }
+
+        std::vector<std::pair<std::shared_ptr<Node>, bool>> operands;
+        flatten(n, op == '+' || op == '-' ? '+' : '*', op == '+' || op == '-' ? '-' : '/', operands);
+
+        for (const std::pair<std::shared_ptr<Node>, bool> &operand : operands)
+            inputs.push_back(operand.first);
+    }
+
+    // A chain like a - b + c - d is flattened into the operands it adds
+    // (a, c) and subtracts (b, d), constants are combined, and the result is
+    // rebuilt as (a + c) - (b + d) with each side balanced. * and / chains are
+    // handled the same way.
+    std::shared_ptr<Node> reassociate(const std::shared_ptr<Node> &n, const std::vector<std::shared_ptr<Node>> &inputs) {
+        char op = opOf(n);
+
+        if (!isChain(op))
+            return replace(n, inputs);
+
+        char plus = op == '+' || op == '-' ? '+' : '*';
+        char minus = plus == '+' ? '-' : '/';
+        double identity = plus == '+' ? 0 : 1;
+
+        std::vector<std::pair<std::shared_ptr<Node>, bool>> operands;
+        flatten(n, plus, minus, operands);
+
+        std::vector<std::shared_ptr<Node>> positive, negative;
+        double constant = identity;
+
+        for (size_t i = 0; i < inputs.size(); i++)
+            if (folding && isValue(inputs[i]))
+                constant = round(apply(operands[i].second ? minus : plus, constant, valueOf(inputs[i])));
+            else
+                (operands[i].second ? negative : positive).push_back(inputs[i]);
+
+        if (constant != identity || positive.empty())
+            positive.push_back(std::make_shared<ValueNode>(constant));
+
+        std::shared_ptr<Node> result = balance(positive, 0, positive.size(), plus);
+
+        if (!negative.empty())
+            result = makeBinary(minus, result, balance(negative, 0, negative.size(), plus));
+
+        return result;
+    }
+
+    // Collects the operands of a chain in source order, each paired with
+    // whether it is subtracted (divided by). Iterative, so chains tens of
+    // thousands of operators long are fine.
+    void flatten(const std::shared_ptr<Node> &n, char plus, char minus, std::vector<std::pair<std::shared_ptr<Node>, bool>> &operands) {
+        std::vector<std::pair<std::shared_ptr<Node>, bool>> stack(1, std::make_pair(n, false));
+
+        while (!stack.empty()) {
+            std::shared_ptr<Node> node = stack.back().first;
+            bool invert = stack.back().second;
+            stack.pop_back();
+
+            char op = opOf(node);
+
+            if (op == plus || op == minus) {
+                BinaryNode *binary = static_cast<BinaryNode *>(node.get());
+
+                stack.push_back(std::make_pair(binary->getRight(), op == minus ? !invert : invert));
+                stack.push_back(std::make_pair(binary->getLeft(), invert));
+            } else
+                operands.push_back(std::make_pair(node, invert));
+        }
+    }
+
+    void sumOperands(const std::shared_ptr<Node> &n, std::vector<std::shared_ptr<Node>> &inputs) {
+        char op = opOf(n);
+        std::vector<std::pair<std::shared_ptr<Node>, bool>> operands;
+
+        if (op == '+' || op == '-')
+            flatten(n, '+', '-', operands);
+
+        if (operands.size() < 3) {
+            childrenOf(n, inputs);
+            return;
+        }
+
+        for (const std::pair<std::shared_ptr<Node>, bool> &operand : operands)
+            inputs.push_back(operand.first);
+    }
+
+    std::shared_ptr<Node> compensate(const std::shared_ptr<Node> &n, const std::vector<std::shared_ptr<Node>> &inputs) {
+        char op = opOf(n);
+        std::vector<std::pair<std::shared_ptr<Node>, bool>> operands;
+
+        if (op == '+' || op == '-')
+            flatten(n, '+', '-', operands);
+
+        if (operands.size() < 3)
+            return replace(n, inputs);
+
+        std::vector<std::shared_ptr<Node>> terms;
+
+        for (size_t i = 0; i < inputs.size(); i++)
+            if (operands[i].second)
+                terms.push_back(std::make_shared<MinusNode>(std::make_shared<ValueNode>(0), inputs[i]));
+            else
+                terms.push_back(inputs[i]);
+
+        return std::make_shared<SumNode>(terms);
+    }
+
+    std::shared_ptr<Node> balance(const std::vector<std::shared_ptr<Node>> &terms, size_t begin, size_t end, char op) {
+        if (end - begin == 1)
+            return terms[begin];
+
+        size_t middle = begin + (end - begin) / 2;
+
+        return makeBinary(op, balance(terms, begin, middle, op), balance(terms, middle, end, op));
+    }
+
+};
+
+// SSA form of an expression, between the tree and the byte code: a list of
+// values, each defined once from values defined before it. Equal values are
+// merged as they are added, so a common subexpression is computed once;
+// every pass rebuilds the list in order, rewriting each value as it goes.
+class IR {
+public:
+    enum Op {
+        Constant,
+        Variable,
+        Parameter,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        Pow,
+        MulAdd, // a * b + addend
+        Sum,
+        Other // a node of an operator the IR doesn't know, which emits itself
+    };
+
+    struct Value {
+        Op op;
+        std::vector<int> operands;
+        double number; // Constant
+        Literal literal; // Constant
+        int index; // Variable, Parameter
+        std::shared_ptr<Node> node; // Other
+    };
+
+    explicit IR(const std::shared_ptr<Node> &tree) {
+        std::unordered_map<const Node *, int> ids;
+        std::vector<std::pair<std::shared_ptr<Node>, size_t>> stack(1, std::make_pair(tree, 0));
+
+        while (!stack.empty()) {
+            std::shared_ptr<Node> n = stack.back().first;
+            size_t i = stack.back().second;
+
+            if (i < n->arity()) {
+                stack.back().second++;
+
+                if (!ids.count(n->child(i).get()))
+                    stack.push_back(std::make_pair(n->child(i), 0));
+            } else {
+                std::vector<int> operands;
+
+                for (size_t j = 0; j < n->arity(); j++)
+                    operands.push_back(ids[n->child(j).get()]);
+
+                ids[n.get()] = add(valueOf(n, operands));
+                stack.pop_back();
+            }
+        }
+
+        result = ids[tree.get()];
+    }
+
+    void setPrecision(Precision precision) {
+        this->precision = precision;
+    }
+
+    // Allows rewrites that round differently: division by any constant
+    // becomes multiplication by its reciprocal, x^n with an integer n up to
+    // 16 becomes multiplications, a * b + c a multiply-add, and polynomials
+    // and shared divisors are rewritten.
+    void setFastMath(bool fastMath) {
+        this->fastMath = fastMath;
+    }
+
+    // Without folding, literals are never combined or dropped, so they stay
+    // bindable.
+    void setFolding(bool folding) {
+        this->folding = folding;
+    }
+
+    // Folds constants and reduces strength, leaving results bit for bit the
+    // same unless fast-math allows otherwise, then drops dead values.
+    void optimize() {
+        std::vector<Value> old;
+        old.swap(values);
+        numbers.clear();
+
+        std::vector<int> map(old.size());
+
+        for (size_t i = 0; i < old.size(); i++) {
+            for (int &operand : old[i].operands)
+                operand = map[operand];
+
+            map[i] = make(old[i]);
+        }
+
+        result = map[result];
+        prune();
+
+        if (fastMath) {
+            polynomials();
+            prune();
+            reciprocals();
+            prune();
+        }
+
+        schedule();
+    }
+
+    const std::vector<Value> &getValues() const {
+        return values;
+    }
+
+    int getResult() const {
+        return result;
+    }
+
+    // Stack code and, unless an Other is left, register code. On the stack,
+    // a value used more than once is computed once, in definition order, and
+    // stays there for Fetch to copy; everything else is inlined into its
+    // one user, the operand needing more stack first.
+    void emit(Compiler *c) const;
+
+private:
+    typedef std::tuple<int, std::vector<int>, uint64_t, int, bool, int, const Node *> Key;
+
+    std::vector<Value> values;
+    int result;
+    std::map<Key, int> numbers;
+
+    Precision precision = Double;
+    bool fastMath = false;
+    bool folding = true;
+
+    static Value valueOf(const std::shared_ptr<Node> &n, const std::vector<int> &operands) {
+        Value v = { Other, operands, 0, { -1, false }, -1, nullptr };
+
+        if (ValueNode *value = dynamic_cast<ValueNode *>(n.get())) {
+            v.op = Constant;
+            v.number = value->getValue();
+            v.literal = value->getLiteral();
+        } else if (VariableNode *variable = dynamic_cast<VariableNode *>(n.get())) {
+            v.op = Variable;
+            v.index = variable->getIndex();
+        } else if (ParameterNode *parameter = dynamic_cast<ParameterNode *>(n.get())) {
+            v.op = Parameter;
+            v.index = parameter->getIndex();
+        } else if (dynamic_cast<PlusNode *>(n.get()))
+            v.op = Add;
+        else if (dynamic_cast<MinusNode *>(n.get()))
+            v.op = Sub;
+        else if (dynamic_cast<MultiplyNode *>(n.get()))
+            v.op = Mul;
+        else if (dynamic_cast<DivideNode *>(n.get()))
+            v.op = Div;
+        else if (dynamic_cast<PowerNode *>(n.get()))
+            v.op = Pow;
+        else if (dynamic_cast<MultiplyAddNode *>(n.get()))
+            v.op = MulAdd, v.operands = { operands[1], operands[2], operands[0] };
+        else if (dynamic_cast<SumNode *>(n.get()))
+            v.op = Sum;
+        else
+            v.node = n;
+
+        return v;
+    }
+
+    static bool isLeaf(Op op) {
+        return op == Constant || op == Variable || op == Parameter;
+    }
+
+    // The value's index, adding it unless an equal one is already there.
+    int add(const Value &v) {
+        uint64_t bits;
+        memcpy(&bits, &v.number, sizeof(bits));
+
+        Key key(v.op, v.operands, bits, v.literal.index, v.literal.negated, v.index, v.node.get());
+        std::map<Key, int>::const_iterator i = numbers.find(key);
+
+        if (i != numbers.end())
+            return i->second;
+
+        values.push_back(v);
+
+        return numbers[key] = static_cast<int>(values.size() - 1);
+    }
+
+    int constant(double number) {
+        return add({ Constant, {}, number, { -1, false }, -1, nullptr });
+    }
+
+    int binary(Op op, int left, int right) {
+        return make({ op, { left, right }, 0, { -1, false }, -1, nullptr });
+    }
+
+    double round(double value) const {
+        return precision == Single ? static_cast<float>(value) : value;
+    }
+
+    // Whether v is a constant that can be relied on to stay `number`.
+    bool is(int v, double number) const {
+        const Value &value = values[v];
+        return value.op == Constant && (folding || value.literal.index < 0) && value.number == number && std::signbit(value.number) == std::signbit(number);
+    }
+
+    // The value of v with its operands' values, all constants.
+    double evaluate(const Value &v) const {
+        std::vector<double> operands;
+
+        for (int operand : v.operands)
+            operands.push_back(round(values[operand].number));
+
+        switch (v.op) {
+        case Add:
+            return operands[0] + operands[1];
+        case Sub:
+            return operands[0] - operands[1];
+        case Mul:
+            return operands[0] * operands[1];
+        case Div:
+            return operands[0] / operands[1];
+        case Pow:
+            return pow(operands[0], operands[1]);
+        case MulAdd:
+            return fma(operands[0], operands[1], operands[2]);
+
+        case Sum: {
+            CompensatedSum<double> sum;
+
+            for (double operand : operands)
+                sum.add(operand);
+
+            return sum.result();
+        }
+
+        default:
+            return v.node->apply(operands.data(), nullptr, nullptr);
+        }
+    }
+
+    // Adds v in its simplest form; its operands are already simplified.
+    int make(Value v) {
+        if (v.op == Constant)
+            return add({ Constant, {}, folding ? round(v.number) : v.number, v.literal, -1, nullptr });
+
+        bool constant = !v.operands.empty() && std::all_of(v.operands.begin(), v.operands.end(), [this](int operand) { return values[operand].op == Constant; });
+
+        if (folding && constant) {
+            // 0 - literal keeps the literal bindable, with the sign on it.
+            if ((v.op == Add || v.op == Sub) && values[v.operands[0]].number == 0 && values[v.operands[0]].literal.index < 0 && values[v.operands[1]].literal.index >= 0
+                && foldsIntoLiteral(v.op == Sub, std::signbit(values[v.operands[0]].number), values[v.operands[1]].literal)) {
+                Literal literal = values[v.operands[1]].literal;
+                literal.negated |= v.op == Sub;
+
+                double number = values[v.operands[1]].number;
+                return add({ Constant, {}, v.op == Sub ? 0 - number : number, literal, -1, nullptr });
+            }
+
+            return this->constant(round(evaluate(v)));
+        }
+
+        int left = v.operands.empty() ? -1 : v.operands[0], right = v.operands.size() < 2 ? -1 : v.operands[1];
+
+        switch (v.op) {
+        case Add:
+            // x + -0 is x for every x, -0 included; x + 0 is not.
+            if (is(right, -0.0))
+                return left;
+            if (is(left, -0.0))
+                return right;
+            if (fastMath && sharesDivisor(left, right))
+                return binary(Div, binary(Add, values[left].operands[0], values[right].operands[0]), values[left].operands[1]);
+            if (fastMath && values[left].op == Mul)
+                return make({ MulAdd, { values[left].operands[0], values[left].operands[1], right }, 0, { -1, false }, -1, nullptr });
+            if (fastMath && values[right].op == Mul)
+                return make({ MulAdd, { values[right].operands[0], values[right].operands[1], left }, 0, { -1, false }, -1, nullptr });
+            break;
+
+        case Sub:
+            if (is(right, 0.0))
+                return left;
+            if (fastMath && sharesDivisor(left, right))
+                return binary(Div, binary(Sub, values[left].operands[0], values[right].operands[0]), values[left].operands[1]);
+            break;
+
+        case Mul:
+            if (is(right, 1))
+                return left;
+            if (is(left, 1))
+                return right;
+            break;
+
+        // Division by a constant is multiplication by its reciprocal when
+        // that is exact, as for powers of two, or under fast-math when it
+        // is merely finite.
+        case Div:
+            if (is(right, 1))
+                return left;
+
+            if (values[right].op == Constant && (folding || values[right].literal.index < 0)) {
+                double divisor = values[right].number, inverse = round(1 / divisor);
+
+                if (std::isfinite(inverse) && inverse != 0 && (fastMath || (isPowerOfTwo(divisor) && isPowerOfTwo(inverse))))
+                    return binary(Mul, left, this->constant(inverse));
+            }
+            break;
+
+        // x^0, x^1 and x^2 are exact as multiplications; fast-math takes
+        // integer powers up to 16 by squaring, and negative ones as 1/x^n.
+        case Pow: {
+            const Value exponent = values[right];
+
+            if (exponent.op != Constant || (!folding && exponent.literal.index >= 0) || exponent.number != std::floor(exponent.number) || std::fabs(exponent.number) > (fastMath ? 16 : 2) || (exponent.number < 0 && !fastMath))
+                break;
+
+            if (exponent.number == 0)
+                return this->constant(1);
+
+            int n = static_cast<int>(std::fabs(exponent.number)), power = -1;
+
+            for (int square = left; n; n >>= 1) {
+                if (n & 1)
+                    power = power < 0 ? square : binary(Mul, power, square);
+
+                if (n > 1)
+                    square = binary(Mul, square, square);
+            }
+
+            return exponent.number < 0 ? binary(Div, this->constant(1), power) : power;
+        }
+
+        default:
+            break;
+        }
+
+        return add(v);
+    }
+
+    // Cycles from issue until the value can be used, roughly as on a
+    // current out-of-order core; pow is a library call.
+    int latency(const Value &v) const {
+        switch (v.op) {
+        case Constant:
+        case Variable:
+        case Parameter:
+            return 4;
+        case Add:
+        case Sub:
+            return 3;
+        case Mul:
+            return 4;
+        case MulAdd:
+            return 5;
+        case Div:
+            return 15;
+        case Pow:
+            return 80;
+        case Sum:
+            return 4 * static_cast<int>(v.operands.size());
+        default:
+            return 20;
+        }
+    }
+
+    static bool isDivider(Op op) {
+        return op == Div || op == Pow;
+    }
+
+    // List scheduling on a single-issue model. Of the values whose operands
+    // are ready, the one with the longest latency path to the result goes
+    // next, so independent chains interleave and long operations start
+    // early. Division and pow take the divider for their whole latency, so
+    // they don't queue up behind each other while other work is ready.
+    void schedule() {
+        size_t n = values.size();
+        std::vector<int> height(n), pending(n), ready(n);
+        std::vector<std::vector<int>> users(n);
+
+        for (size_t v = 0; v < n; v++) {
+            std::vector<int> operands = values[v].operands;
+            std::sort(operands.begin(), operands.end());
+            operands.erase(std::unique(operands.begin(), operands.end()), operands.end());
+
+            for (int operand : operands)
+                users[operand].push_back(static_cast<int>(v));
+
+            pending[v] = static_cast<int>(operands.size());
+        }
+
+        for (size_t v = n; v-- > 0;) {
+            height[v] = latency(values[v]);
+
+            for (int user : users[v])
+                height[v] = std::max(height[v], latency(values[v]) + height[user]);
+        }
+
+        typedef std::pair<int, int> Entry;
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> waiting; // by ready cycle
+        std::priority_queue<Entry> available; // by height
+
+        for (size_t v = 0; v < n; v++)
+            if (!pending[v])
+                waiting.push(Entry(0, static_cast<int>(v)));
+
+        std::vector<int> order, blocked;
+        int cycle = 0, divider = 0;
+
+        while (order.size() < n) {
+            while (!waiting.empty() && waiting.top().first <= cycle) {
+                available.push(Entry(height[waiting.top().second], waiting.top().second));
+                waiting.pop();
+            }
+
+            int next = -1;
+
+            while (!available.empty() && next < 0) {
+                int v = available.top().second;
+                available.pop();
+
+                if (isDivider(values[v].op) && divider > cycle)
+                    blocked.push_back(v);
+                else
+                    next = v;
+            }
+
+            for (int v : blocked)
+                available.push(Entry(height[v], v));
+
+            if (next < 0) {
+                // Nothing can issue: skip to when something can.
+                int wake = waiting.empty() ? divider : waiting.top().first;
+
+                if (!blocked.empty())
+                    wake = std::min(wake, divider);
+
+                blocked.clear();
+                cycle = std::max(cycle + 1, wake);
+                continue;
+            }
+
+            blocked.clear();
+            order.push_back(next);
+
+            int done = cycle + latency(values[next]);
+
+            if (isDivider(values[next].op))
+                divider = done;
+
+            for (int user : users[next]) {
+                ready[user] = std::max(ready[user], done);
+
+                if (!--pending[user])
+                    waiting.push(Entry(ready[user], user));
+            }
+
+            cycle++;
+        }
+
+        std::vector<Value> old;
+        old.swap(values);
+        numbers.clear();
+
+        std::vector<int> map(n);
+
+        for (int v : order) {
+            for (int &operand : old[v].operands)
+                operand = map[operand];
+
+            map[v] = add(old[v]);
+        }
+
+        result = map[result];
+    }
+
+    static bool isPowerOfTwo(double value) {
+        int exponent;
+        return std::isfinite(value) && std::fabs(std::frexp(value, &exponent)) == 0.5;
+    }
+
+    // c * x^degree, with x = -1 for a constant.
+    struct Monomial {
+        int base;
+        int degree;
+        double coefficient;
+    };
+
+    static const int maxDegree = 64;
+
+    // Extends `known` to every value, each as a monomial: a product or
+    // quotient of constants and integer powers of one value. Anything else
+    // is a monomial of degree 1 in itself. Values only refer to earlier
+    // ones, so one forward pass sees every operand before its users.
+    void monomials(std::vector<Monomial> &known) const {
+        for (size_t v = known.size(); v < values.size(); v++) {
+            const Value &value = values[v];
+            Monomial m = { static_cast<int>(v), 1, 1 };
+
+            if (value.op == Constant && (folding || value.literal.index < 0))
+                m = { -1, 0, value.number };
+            else if (value.op == Mul || value.op == Div) {
+                const Monomial &left = known[value.operands[0]], &right = known[value.operands[1]];
+
+                if (value.op == Mul)
+                    m = product(left, right, m);
+                else if (right.base < 0)
+                    m = { left.base, left.degree, left.coefficient / right.coefficient };
+            } else if (value.op == Pow && values[value.operands[1]].op == Constant) {
+                const Monomial &base = known[value.operands[0]];
+                double exponent = values[value.operands[1]].number;
+
+                if (exponent >= 0 && exponent == std::floor(exponent) && base.degree * exponent <= maxDegree && (folding || values[value.operands[1]].literal.index < 0))
+                    m = { base.base, static_cast<int>(base.degree * exponent), pow(base.coefficient, exponent) };
+            }
+
+            known.push_back(m);
+        }
+    }
+
+    // left * right, or `otherwise` if they are in different values.
+    static Monomial product(const Monomial &left, const Monomial &right, const Monomial &otherwise) {
+        if (left.base >= 0 && right.base >= 0 && left.base != right.base)
+            return otherwise;
+
+        if (left.degree + right.degree > maxDegree)
+            return otherwise;
+
+        return { left.base >= 0 ? left.base : right.base, left.degree + right.degree, left.coefficient * right.coefficient };
+    }
+
+    // A term of a +/- chain: factor, times `by` unless that is -1, negated
+    // if `negative`. Multiply-adds contribute their product as a term.
+    struct Term {
+        int factor;
+        int by;
+        bool negative;
+    };
+
+    static bool isChain(Op op) {
+        return op == Add || op == Sub || op == MulAdd;
+    }
+
+    // Fast-math: a +/- chain (multiply-adds included) with at least two
+    // terms in powers of the same value x, one of them x^2 or higher, has
+    // those terms collected into a polynomial in x. It is evaluated by
+    // Horner's rule with a multiply-add per coefficient, or from degree 6
+    // by Estrin's scheme, which splits it into independent halves at the
+    // cost of computing x^2, x^4, ...; the remaining terms are added to it.
+    void polynomials() {
+        std::vector<int> uses(values.size()), user(values.size(), -1);
+
+        for (size_t v = 0; v < values.size(); v++)
+            for (int operand : values[v].operands) {
+                uses[operand]++;
+                user[operand] = static_cast<int>(v);
+            }
+
+        // Whether v is a link of the chain of its one user.
+        auto inner = [&](int v) {
+            if (!isChain(values[v].op) || uses[v] != 1 || v == result)
+                return false;
+
+            const Value &u = values[user[v]];
+            return u.op == Add || u.op == Sub || (u.op == MulAdd && u.operands[2] == v);
+        };
+
+        std::vector<Value> old = values;
+        std::vector<bool> links(old.size());
+
+        for (size_t v = 0; v < old.size(); v++)
+            links[v] = inner(static_cast<int>(v));
+
+        values.clear();
+        numbers.clear();
+
+        std::vector<int> map(old.size());
+        std::vector<Monomial> known;
+
+        for (size_t v = 0; v < old.size(); v++) {
+            Value value = old[v];
+
+            for (int &operand : value.operands)
+                operand = map[operand];
+
+            map[v] = isChain(value.op) && !links[v] ? polynomial(old, links, static_cast<int>(v), map, known) : -1;
+
+            if (map[v] < 0)
+                map[v] = make(value);
+        }
+
+        result = map[result];
+    }
+
+    // The chain rooted at old value `root` rebuilt around a polynomial, or
+    // -1 if it has none.
+    int polynomial(const std::vector<Value> &old, const std::vector<bool> &links, int root, const std::vector<int> &map, std::vector<Monomial> &known) {
+        std::vector<Term> terms;
+        std::vector<std::pair<int, bool>> stack(1, std::make_pair(root, false));
+
+        while (!stack.empty()) {
+            int v = stack.back().first;
+            bool negative = stack.back().second;
+            stack.pop_back();
+
+            const Value &value = old[v];
+
+            if (v != root && !links[v])
+                terms.push_back(Term{ map[v], -1, negative });
+            else if (value.op == MulAdd) {
+                terms.push_back(Term{ map[value.operands[0]], map[value.operands[1]], negative });
+                stack.push_back(std::make_pair(value.operands[2], negative));
+            } else {
+                stack.push_back(std::make_pair(value.operands[1], value.op == Sub ? !negative : negative));
+                stack.push_back(std::make_pair(value.operands[0], negative));
+            }
+        }
+
+        std::vector<Monomial> monomials;
+        int base = -1, degree = 0;
+
+        this->monomials(known);
+
+        for (const Term &term : terms) {
+            Monomial m = known[term.factor];
+
+            if (term.by >= 0)
+                m = product(m, known[term.by], Monomial{ -2, 0, 0 });
+
+            monomials.push_back(m);
+
+            if (m.base >= 0 && m.degree > degree)
+                base = m.base, degree = m.degree;
+        }
+
+        if (degree < 2 || std::count_if(monomials.begin(), monomials.end(), [base](const Monomial &m) { return m.base == base; }) < 2)
+            return -1;
+
+        std::vector<double> coefficients(degree + 1);
+        std::vector<Term> rest;
+
+        for (size_t i = 0; i < terms.size(); i++)
+            if (monomials[i].base == base || monomials[i].base == -1)
+                coefficients[monomials[i].degree] += terms[i].negative ? -monomials[i].coefficient : monomials[i].coefficient;
+            else
+                rest.push_back(terms[i]);
+
+        std::vector<int> constants;
+
+        for (double coefficient : coefficients)
+            constants.push_back(this->constant(round(coefficient)));
+
+        int p = degree < 6 ? horner(constants, base) : estrin(constants, base);
+
+        for (const Term &term : rest)
+            if (term.by >= 0 && !term.negative)
+                p = make({ MulAdd, { term.factor, term.by, p }, 0, { -1, false }, -1, nullptr });
+            else
+                p = binary(term.negative ? Sub : Add, p, term.by >= 0 ? binary(Mul, term.factor, term.by) : term.factor);
+
+        return p;
+    }
+
+    bool isZero(int v) const {
+        return values[v].op == Constant && values[v].number == 0;
+    }
+
+    // a * x + b, leaving out a zero a or b.
+    int multiplyAdd(int a, int x, int b) {
+        if (isZero(a))
+            return b;
+
+        int product = binary(Mul, a, x);
+
+        if (isZero(b))
+            return product;
+
+        return product == x ? binary(Add, x, b) : make({ MulAdd, { a, x, b }, 0, { -1, false }, -1, nullptr });
+    }
+
+    int horner(const std::vector<int> &coefficients, int x) {
+        int p = coefficients.back();
+
+        for (size_t i = coefficients.size() - 1; i-- > 0;)
+            p = multiplyAdd(p, x, coefficients[i]);
+
+        return p;
+    }
+
+    int estrin(std::vector<int> coefficients, int x) {
+        for (int power = x; coefficients.size() > 1; power = binary(Mul, power, power)) {
+            std::vector<int> next;
+
+            for (size_t i = 0; i < coefficients.size(); i += 2)
+                next.push_back(i + 1 < coefficients.size() ? multiplyAdd(coefficients[i + 1], power, coefficients[i]) : coefficients[i]);
+
+            coefficients.swap(next);
+        }
+
+        return coefficients[0];
+    }
+
+    // a / d and b / d, with the same d.
+    bool sharesDivisor(int left, int right) const {
+        return values[left].op == Div && values[right].op == Div && values[left].operands[1] == values[right].operands[1];
+    }
+
+    // Fast-math: a divisor of more than one division is inverted once, and
+    // the divisions become multiplications by the reciprocal.
+    void reciprocals() {
+        std::vector<int> divisions(values.size());
+
+        for (const Value &v : values)
+            if (v.op == Div)
+                divisions[v.operands[1]]++;
+
+        std::vector<Value> old;
+        old.swap(values);
+        numbers.clear();
+
+        std::vector<int> map(old.size());
+
+        for (size_t i = 0; i < old.size(); i++) {
+            bool shared = old[i].op == Div && divisions[old[i].operands[1]] > 1;
+
+            for (int &operand : old[i].operands)
+                operand = map[operand];
+
+            map[i] = shared ? binary(Mul, old[i].operands[0], binary(Div, this->constant(1), old[i].operands[1])) : make(old[i]);
+        }
+
+        result = map[result];
+    }
+
+    // Keeps only the values the result depends on.
+    void prune() {
+        std::vector<bool> live(values.size());
+        live[result] = true;
+
+        for (size_t i = values.size(); i-- > 0;)
+            if (live[i])
+                for (int operand : values[i].operands)
+                    live[operand] = true;
+
+        std::vector<Value> old;
+        old.swap(values);
+        numbers.clear();
+
+        std::vector<int> map(old.size(), -1);
+
+        for (size_t i = 0; i < old.size(); i++)
+            if (live[i]) {
+                for (int &operand : old[i].operands)
+                    operand = map[operand];
+
+                map[i] = add(old[i]);
+            }
+
+        result = map[result];
+    }
+};
+
+inline void IR::emit(Compiler *c) const {
+    size_t n = values.size();
+    std::vector<int> uses(n), need(n, 1), slots(n, -1), pool(n, -1);
+
+    // Values of constants and parameters alone are the same for every row.
+    // Those that aren't leaves are computed into pool entries up front and
+    // are leaves to the code, which only sees the values it needs per row.
+    std::vector<bool> invariant(n), live(n);
+
+    for (size_t v = 0; v < n; v++)
+        invariant[v] = values[v].op != Variable && values[v].op != Other && std::all_of(values[v].operands.begin(), values[v].operands.end(), [&](int operand) { return invariant[operand]; });
+
+    auto leaf = [&](int v) {
+        return isLeaf(values[v].op) || invariant[v];
+    };
+
+    live[result] = true;
+
+    for (size_t v = n; v-- > 0;)
+        if (live[v] && !leaf(static_cast<int>(v)))
+            for (int operand : values[v].operands) {
+                live[operand] = true;
+                uses[operand]++;
+            }
+
+    uses[result]++;
+
+    auto shared = [&](int v) {
+        return !leaf(v) && uses[v] > 1;
+    };
+
+    auto needOf = [&](int v) {
+        return leaf(v) || shared(v) ? 1 : need[v];
+    };
+
+    auto reversible = [&](int v) {
+        Op op = values[v].op;
+        return op == Add || op == Sub || op == Mul || op == Div;
+    };
+
+    // Operands in the order they go on the stack, and whether that is the
+    // reversed form of the operation. A reversible operation takes its
+    // needier operand first. A multiply-add takes its needier factor
+    // first, and its addend first, which the JIT finishes with a multiply
+    // and an add from the spill slots, unless last needs less stack.
+    auto order = [&](int v, bool &reversed) {
+        const Value &value = values[v];
+        std::vector<int> operands = value.operands;
+        reversed = false;
+
+        if (reversible(v) && needOf(operands[1]) > needOf(operands[0])) {
+            std::swap(operands[0], operands[1]);
+            reversed = true;
+        } else if (value.op == MulAdd) {
+            int a = operands[0], b = operands[1], addend = operands[2];
+
+            if (needOf(b) > needOf(a))
+                std::swap(a, b);
+
+            reversed = std::max(needOf(a), std::max(needOf(b) + 1, needOf(addend) + 2)) < std::max(needOf(addend), std::max(needOf(a) + 1, needOf(b) + 2));
+            operands = reversed ? std::vector<int>{ a, b, addend } : std::vector<int>{ addend, a, b };
+        }
+
+        return operands;
+    };
+
+    for (size_t v = 0; v < n; v++) {
+        bool reversed;
+        std::vector<int> operands = order(static_cast<int>(v), reversed);
+
+        for (size_t j = 0; j < operands.size(); j++)
+            need[v] = std::max(need[v], needOf(operands[j]) + static_cast<int>(j));
+    }
+
+    auto entry = [&](int v) {
+        if (pool[v] < 0)
+            pool[v] = values[v].op == Parameter ? c->parameter(values[v].index) : c->constant(values[v].number, values[v].literal);
+
+        return pool[v];
+    };
+
+    for (size_t v = 0; v < n; v++) {
+        const Value &value = values[v];
+
+        if (!invariant[v] || isLeaf(value.op))
+            continue;
+
+        std::vector<int> entries;
+
+        for (int operand : value.operands)
+            entries.push_back(entry(operand));
+
+        switch (value.op) {
+        case MulAdd:
+            pool[v] = c->derive(VM::MulAdd, entries[0], entries[1], entries[2]);
+            break;
+
+        case Sum:
+            pool[v] = c->derive(VM::Sum, c->sum(entries), static_cast<int>(entries.size()));
+            break;
+
+        default: {
+            static const VM::ByteCode codes[] = { VM::Add, VM::Sub, VM::Mul, VM::Div, VM::Pow };
+            pool[v] = c->derive(codes[value.op - Add], entries[0], entries[1]);
+            break;
+        }
+        }
+    }
+
+    auto load = [&](int v) {
+        const Value &value = values[v];
+
+        if (slots[v] >= 0) {
+            c->gen(VM::Fetch);
+            c->gen(slots[v]);
+        } else if (value.op == Variable) {
+            c->gen(VM::Load);
+            c->gen(c->variable(value.index));
+        } else {
+            c->gen(VM::Push);
+            c->gen(entry(v));
+        }
+
+        c->push();
+    };
+
+    auto tree = [&](int root) {
+        struct Frame {
+            int value;
+            size_t next;
+            bool reversed;
+        };
+
+        auto frame = [&](int v) {
+            Frame f = { v, 0, false };
+            order(v, f.reversed);
+            return f;
+        };
+
+        std::vector<Frame> stack(1, frame(root));
+
+        while (!stack.empty()) {
+            Frame &f = stack.back();
+            const Value &value = values[f.value];
+            std::vector<int> operands = order(f.value, f.reversed);
+
+            if (f.next < operands.size()) {
+                int operand = operands[f.next];
+                f.next++;
+
+                if (leaf(operand) || slots[operand] >= 0)
+                    load(operand);
+                else
+                    stack.push_back(frame(operand));
+
+                continue;
+            }
+
+            switch (value.op) {
+            case Add:
+            case Mul:
+                c->gen(value.op == Add ? VM::Add : VM::Mul);
+                c->pop();
+                break;
+
+            case Sub:
+                c->gen(f.reversed ? VM::SubR : VM::Sub);
+                c->pop();
+                break;
+
+            case Div:
+                c->gen(f.reversed ? VM::DivR : VM::Div);
+                c->pop();
+                break;
+
+            case Pow:
+                c->gen(VM::Pow);
+                c->pop();
+                break;
+
+            case MulAdd:
+                c->gen(f.reversed ? VM::MulAddR : VM::MulAdd);
+                c->pop();
+                c->pop();
+                break;
+
+            case Sum:
+                c->gen(VM::Sum);
+                c->gen(static_cast<int>(operands.size()));
+
+                for (size_t j = 1; j < operands.size(); j++)
+                    c->pop();
+                break;
+
+            default:
+                value.node->emit(c);
+                break;
+            }
+
+            stack.pop_back();
+        }
+    };
+
+    int locals = 0;
+
+    for (size_t v = 0; v < n; v++)
+        if (shared(static_cast<int>(v)) && static_cast<int>(v) != result) {
+            tree(static_cast<int>(v));
+            slots[v] = locals++;
+        }
+
+    if (leaf(result))
+        load(result);
+    else
+        tree(result);
+
+    if (std::any_of(values.begin(), values.end(), [](const Value &v) { return v.op == Other; }))
+        return;
+
+    // Register code: one register per value from its definition to its last
+    // use, after which the register is reused.
+    std::vector<int> last(n, -1), registers(n, -1), free;
+    int count = 0;
+
+    for (size_t v = 0; v <= static_cast<size_t>(result); v++)
+        if (live[v] && !leaf(static_cast<int>(v)))
+            for (int operand : values[v].operands)
+                last[operand] = static_cast<int>(v);
+
+    for (size_t v = 0; v <= static_cast<size_t>(result); v++) {
+        if (!live[v])
+            continue;
+
+        const Value &value = values[v];
+        bool input = leaf(static_cast<int>(v));
+        std::vector<int> operands;
+
+        if (!input)
+            for (int operand : value.operands) {
+                operands.push_back(registers[operand]);
+
+                if (last[operand] == static_cast<int>(v) && std::find(free.begin(), free.end(), registers[operand]) == free.end())
+                    free.push_back(registers[operand]);
+            }
+
+        int target = count;
+
+        if (free.empty())
+            count++;
+        else {
+            target = free.back();
+            free.pop_back();
+        }
+
+        registers[v] = target;
+
+        if (value.op == Variable) {
+            c->instruction(VM::Load, target, c->variable(value.index));
+            continue;
+        }
+
+        if (input) {
+            c->instruction(VM::Push, target, entry(static_cast<int>(v)));
+            continue;
+        }
+
+        switch (value.op) {
+        case Add:
+        case Sub:
+        case Mul:
+        case Div:
+        case Pow: {
+            static const VM::ByteCode codes[] = { VM::Add, VM::Sub, VM::Mul, VM::Div, VM::Pow };
+            c->instruction(codes[value.op - Add], target, operands[0], operands[1]);
+            break;
+        }
+
+        case MulAdd:
+            c->instruction(VM::MulAdd, target, operands[0], operands[1], operands[2]);
+            break;
+
+        default:
+            c->instruction(VM::Sum, target, c->sum(operands), static_cast<int>(operands.size()));
+            break;
+        }
+    }
+}
+
+inline Function Compiler::compile(const IR &ir) {
+    start();
+    ir.emit(this);
+
+    return finish();
+}
+
+struct Token {
+    char id;
+    std::string text;
+};
+
+class Lexer {
+public:
+    std::vector<Token> lex(const std::string &expr) {
+        size_t pos = 0;
+        std::vector<Token> tokens;
+
+        while (true) {
+            while (isspace(expr[pos]))
+                pos++;
+
+            if (expr[pos] == '\0') {
+                tokens.push_back({ 'e', "" });
+                break;
+            } else if (isdigit(expr[pos])) {
+                std::string text;
+
+                while (isdigit(expr[pos]))
+                    text += expr[pos++];
+
+                if (expr[pos] == '.')
+                    do
+                        text += expr[pos++];
+                    while (isdigit(expr[pos]));
+
+                tokens.push_back({ 'n', text });
+            } else if (isalpha(expr[pos])) {
+                std::string text;
+
+                while (isalnum(expr[pos]))
+                    text += expr[pos++];
+
+                tokens.push_back({ 'i', text });
+            } else
+                tokens.push_back({ (ispunct(static_cast<unsigned char>(expr[pos])) ? expr[pos] : 'u'), std::string() + expr[pos++] });
+        }
+
+        return tokens;
+    }
+};
+
+class Parser {
+    std::vector<Token> tokens;
+    std::vector<Token>::const_iterator token;
+    std::vector<std::string> variables;
+    std::vector<std::string> parameters;
+
+    std::vector<std::shared_ptr<Node>> operands;
+    std::vector<char> operators;
+    int literals;
+
+public:
+    enum Associativity {
+        Left,
+        Right
+    };
+
+    typedef std::function<std::shared_ptr<Node>(std::shared_ptr<Node>, std::shared_ptr<Node>)> Factory;
+
+private:
+    struct Operator {
+        int precedence;
+        Associativity associativity;
+        Factory factory;
+    };
+
+    // Indexed by the operator character; precedence 0 marks a free slot.
+    Operator table[256] = {};
+
+public:
+    Parser() {
+        for (char op : std::string("+-"))
+            addOperator(op, 1, Left, [op](std::shared_ptr<Node> left, std::shared_ptr<Node> right) { return makeBinary(op, left, right); });
+
+        for (char op : std::string("*/"))
+            addOperator(op, 2, Left, [op](std::shared_ptr<Node> left, std::shared_ptr<Node> right) { return makeBinary(op, left, right); });
+
+        addOperator('^', 3, Right, [](std::shared_ptr<Node> left, std::shared_ptr<Node> right) { return makeBinary('^', left, right); });
+    }
+
+    // Registers (or redefines) a binary operator spelled as a single
+    // punctuation character. Higher precedence binds tighter.
+    void addOperator(char op, int precedence, Associativity associativity, Factory factory) {
+        if (!ispunct(static_cast<unsigned char>(op)) || op == '(' || op == ')' || precedence <= 0)
+            throw std::invalid_argument(std::string("can't define operator '") + op + "'");
+
+        table[static_cast<unsigned char>(op)] = { precedence, associativity, factory };
+    }
+
+    void setVariables(const std::vector<std::string> &variables) {
+        this->variables = variables;
+    }
+
+    // Names looked up after the variables; they become ParameterNodes.
+    void setParameters(const std::vector<std::string> &parameters) {
+        this->parameters = parameters;
+    }
+
+    // Number of numeric literals in the last parsed expression; they are
+    // indexed in source order for Function::rebind.
+    int getLiteralCount() const {
+        return literals;
+    }
+
+    // Precedence climbing over explicit operand and operator stacks, driven
+    // by the operator table, so nesting depth is bounded by memory rather
+    // than the C++ stack. '(' and the unary signs 'p'/'m' are kept on the
+    // operator stack as markers.
+    std::shared_ptr<Node> parse(const std::vector<Token> &tokens) {
+        this->tokens = tokens;
+        token = this->tokens.begin();
+
+        operands.clear();
+        operators.clear();
+        literals = 0;
+
+        bool operand = true;
+
+        while (true) {
+            if (operand) {
+                if (accept('+'))
+                    operators.push_back('p');
+                else if (accept('-'))
+                    operators.push_back('m');
+
+                if (accept('(')) {
+                    operators.push_back('(');
+                    continue;
+                }
+
+                term();
+                unary();
+
+                operand = false;
+            } else if (accept(')')) {
+                while (!operators.empty() && operators.back() != '(')
+                    reduce();
+
+                if (operators.empty())
+                    throw std::runtime_error("there's an excess part of expression");
+
+                operators.pop_back();
+                unary();
+            } else if (int p = precedence(token->id)) {
+                // A right associative operator leaves an equal one on the
+                // stack, so 2^3^2 is 2^(3^2).
+                bool right = table[static_cast<unsigned char>(token->id)].associativity == Right;
+
+                while (!operators.empty() && (right ? precedence(operators.back()) > p : precedence(operators.back()) >= p))
+                    reduce();
+
+                operators.push_back(token->id);
+                getToken();
+
+                operand = true;
+            } else
+                break;
+        }
+
+        while (!operators.empty()) {
+            if (operators.back() == '(')
+                throw std::runtime_error("unmatched parentheses");
+
+            reduce();
+        }
+
+        if (!check('e'))
+            throw std::runtime_error("there's an excess part of expression");
+
+        std::shared_ptr<Node> n = operands.back();
+        operands.clear();
+
+        return n;
+    }
+
+private:
+    void getToken() {
+        ++token;
+    }
+
+    bool check(char id) {
+        return token->id == id;
+    }
+
+    bool accept(char id) {
+        if (check(id)) {
+            getToken();
+            return true;
+        }
+
+        return false;
+    }
+
+    int precedence(char op) const {
+        return table[static_cast<unsigned char>(op)].precedence;
+    }
+
+    void reduce() {
+        std::shared_ptr<Node> right = operands.back();
+        operands.pop_back();
+
+        std::shared_ptr<Node> left = operands.back();
+        operands.pop_back();
+
+        operands.push_back(table[static_cast<unsigned char>(operators.back())].factory(left, right));
+        operators.pop_back();
+    }
+
+    // A sign applies to the term right after it only, so -2^2 is (0-2)^2.
+    void unary() {
+        if (operators.empty() || (operators.back() != 'p' && operators.back() != 'm'))
+            return;
+
+        std::shared_ptr<Node> n = operands.back();
+        operands.pop_back();
+
+        if (operators.back() == 'p')
+            operands.push_back(std::make_shared<PlusNode>(std::make_shared<ValueNode>(0), n));
+        else
+            operands.push_back(std::make_shared<MinusNode>(std::make_shared<ValueNode>(0), n));
+
+        operators.pop_back();
+    }
+
+    void term() {
+        if (check('n')) {
+            operands.push_back(std::make_shared<ValueNode>(std::stod(token->text), Literal { literals++, false }));
+            getToken();
+        } else if (check('i')) {
+            std::vector<std::string>::const_iterator i = std::find(variables.begin(), variables.end(), token->text);
+            std::vector<std::string>::const_iterator j = std::find(parameters.begin(), parameters.end(), token->text);
+
+            if (i != variables.end())
+                operands.push_back(std::make_shared<VariableNode>(static_cast<int>(i - variables.begin())));
+            else if (j != parameters.end())
+                operands.push_back(std::make_shared<ParameterNode>(static_cast<int>(j - parameters.begin())));
+            else
+                throw std::runtime_error("unknown variable '" + token->text + "'");
+
+            getToken();
+        } else if (check('u') || (ispunct(static_cast<unsigned char>(token->id)) && !precedence(token->id) && !check('(') && !check(')')))
+            throw std::runtime_error("unknown token '" + token->text + "'");
+        else if (check('e'))
+            throw std::runtime_error("unexpected end of expression");
+        else
+            throw std::runtime_error("unexpected token '" + token->text + "'");
+    }
+};
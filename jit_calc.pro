@@ -4,10 +4,19 @@ CONFIG += console c++11
 INCLUDEPATH += ../compiler/compiler
 LIBS += -L../compiler/compiler/release -lcompiler
 
+unix: DEFINES += _FILE_OFFSET_BITS=64
+
 #QMAKE_CXXFLAGS_RELEASE -= -O1
 #QMAKE_CXXFLAGS_RELEASE -= -O2
 #QMAKE_CXXFLAGS_RELEASE -= -O3
 #QMAKE_CXXFLAGS_RELEASE += -O0
 
+HEADERS += \
+    jit_calc.h \
+    jc.h \
+    jc_async.h
+
 SOURCES += \
-    jit_calc.cpp
+    jit_calc.cpp \
+    jc.cpp \
+    jc_registry.cpp
@@ -0,0 +1,239 @@
+// Test of the coroutine interface in jc_async.h, driven by a toy event
+// loop that resumes whatever is queued on it, in order, until nothing is:
+//
+//   qmake && make && ./async
+//
+// A job is run with jc::chunks, checking the progress after each chunk,
+// and with jc::evaluate next to another coroutine that must get to run
+// between the chunks. Then a job is cancelled after a few yields, which
+// must end it with JC_ERROR_CANCELLED. Exits with 1 on a failed check.
+
+#include "jc_async.h"
+
+#include <cstdio>
+#include <deque>
+#include <vector>
+
+#if !defined(__cpp_impl_coroutine)
+#error "jc_async.h needs a compiler with C++20 coroutines"
+#endif
+
+namespace {
+int failures = 0;
+
+void check(bool ok, const char *what) {
+    if (!ok && failures++ < 10)
+        fprintf(stderr, "failed: %s\n", what);
+}
+
+class Loop {
+public:
+    auto yield() {
+        struct Yield {
+            Loop *loop;
+
+            bool await_ready() const noexcept {
+                return false;
+            }
+
+            void await_suspend(std::coroutine_handle<> handle) {
+                loop->queue.push_back(handle);
+            }
+
+            void await_resume() const noexcept {
+            }
+        };
+
+        return Yield { this };
+    }
+
+    void run() {
+        while (!queue.empty()) {
+            std::coroutine_handle<> handle = queue.front();
+            queue.pop_front();
+            handle.resume();
+        }
+    }
+
+private:
+    std::deque<std::coroutine_handle<>> queue;
+};
+
+// Starts a coroutine at once and frees it when it ends, for the tasks the
+// loop runs at the top.
+struct Spawn {
+    struct promise_type {
+        Spawn get_return_object() {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() noexcept {
+        }
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+};
+
+Spawn finish(jc::Task task, jc_status &status, bool &done) {
+    status = co_await task;
+    done = true;
+}
+
+// Runs between the chunks, so it sees the job at every chunk boundary.
+Spawn tick(Loop &loop, const jc_job *job, const bool &done, std::vector<size_t> &seen) {
+    while (!done) {
+        seen.push_back(jc_job_progress(job));
+        co_await loop.yield();
+    }
+}
+
+const size_t rows = 10000;
+const size_t chunk = 1000;
+
+struct Batch {
+    std::vector<double> x, y, out;
+    const double *columns[2];
+
+    Batch()
+        : x(rows), y(rows), out(rows, -1) {
+        for (size_t r = 0; r < rows; r++) {
+            x[r] = r * 0.5;
+            y[r] = static_cast<double>(r);
+        }
+
+        columns[0] = x.data();
+        columns[1] = y.data();
+    }
+
+    // Rows evaluated so far hold x * 2 + y and the rest are untouched.
+    bool evaluated(size_t done) const {
+        for (size_t r = 0; r < rows; r++)
+            if (out[r] != (r < done ? x[r] * 2 + y[r] : -1))
+                return false;
+
+        return true;
+    }
+};
+
+jc_job *create(const jc_expr *e, Batch &batch) {
+    jc_job *job = nullptr;
+
+    check(jc_job_create(e, batch.columns, rows, batch.out.data(), &job) == JC_OK && job, "create");
+
+    return job;
+}
+
+void chunks(const jc_expr *e) {
+    Batch batch;
+    jc_job *job = create(e, batch);
+
+    if (!job)
+        return;
+
+    jc::Chunks chunks = jc::chunks(job, chunk);
+    size_t expected = 0;
+
+    while (chunks.next()) {
+        expected += chunk;
+        check(chunks.progress() == expected && jc_job_progress(job) == expected, "chunk progress");
+        check(!jc_job_finished(job), "finished early");
+    }
+
+    check(chunks.status() == JC_OK, "chunks status");
+    check(jc_job_finished(job) && jc_job_progress(job) == rows, "chunks completion");
+    check(batch.evaluated(rows), "chunks results");
+
+    jc_job_free(job);
+}
+
+void evaluate(const jc_expr *e) {
+    Batch batch;
+    jc_job *job = create(e, batch);
+
+    if (!job)
+        return;
+
+    Loop loop;
+    jc_status status = JC_ERROR_INTERNAL;
+    bool done = false;
+    std::vector<size_t> seen;
+
+    finish(jc::evaluate(job, chunk, 0, [&] { return loop.yield(); }), status, done);
+    tick(loop, job, done, seen);
+
+    loop.run();
+
+    check(done && status == JC_OK, "evaluate status");
+    check(jc_job_finished(job) && jc_job_progress(job) == rows, "evaluate completion");
+    check(batch.evaluated(rows), "evaluate results");
+    // The job yields after every chunk but the last.
+    check(seen.size() == rows / chunk - 1, "other work between chunks");
+
+    for (size_t i = 0; i < seen.size(); i++)
+        check(seen[i] == (i + 1) * chunk, "progress between chunks");
+
+    jc_job_free(job);
+}
+
+void cancel(const jc_expr *e) {
+    const int yields = 3;
+
+    Batch batch;
+    jc_job *job = create(e, batch);
+
+    if (!job)
+        return;
+
+    Loop loop;
+    jc_status status = JC_OK;
+    bool done = false;
+    int yielded = 0;
+
+    finish(jc::evaluate(job, chunk, 0, [&] {
+        if (++yielded == yields)
+            jc_job_cancel(job);
+
+        return loop.yield();
+    }), status, done);
+
+    loop.run();
+
+    check(done && status == JC_ERROR_CANCELLED, "cancelled job returns JC_ERROR_CANCELLED");
+    check(yielded == yields, "no chunk after the cancel");
+    check(jc_job_finished(job), "cancelled job is finished");
+    check(jc_job_progress(job) == yields * chunk && batch.evaluated(yields * chunk), "rows before the cancel");
+    check(jc_job_run(job, 0, 0) == JC_ERROR_CANCELLED && jc_job_progress(job) == yields * chunk, "run after the cancel");
+
+    jc_job_free(job);
+}
+}
+
+int main() {
+    static const char *const vars[] = { "x", "y" };
+    jc_expr *e = nullptr;
+
+    if (jc_compile("x * 2 + y", vars, 2, &e) != JC_OK) {
+        fprintf(stderr, "failed: compile: %s\n", jc_last_error());
+        return 1;
+    }
+
+    chunks(e);
+    evaluate(e);
+    cancel(e);
+
+    jc_free(e);
+
+    printf("%d failures\n", failures);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,276 @@
+// Differential test of the lowerings: random expressions are compiled
+// through the IR and run as stack code, as register code and in batches,
+// which must agree bit for bit, NaNs aside. Without fast-math the stack
+// code compiled straight from the tree must agree as well, and in double
+// precision so must the tree walker. Every mode combination of
+// fast-math, precision, folding, compensation and reassociation is
+// covered, and each expression is run again after its parameter changes.
+//
+// Every function is also compiled to x87 code, with its own and with a
+// shared pool, for an array and for scalar arguments, which checks that
+// the code stays within its frame. On a 32-bit x86 host the code is run
+// too, and without fast-math and powers it must agree bit for bit with
+// the stack code on the rows small enough that the x87 exponent range
+// makes no difference.
+//
+//   ./lowering [expressions] [seed]
+//
+// Prints the first mismatches and exits with 1 if there are any.
+
+#include "jit_calc.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+#if defined(__i386__) || defined(_M_IX86)
+#define RUN_COMPILED
+
+#ifdef _MSC_VER
+#include <float.h>
+#endif
+#endif
+
+namespace {
+std::mt19937 generator;
+
+int below(int n) {
+    return static_cast<int>(generator() % n);
+}
+
+// A term of up to `depth` levels of operators over x, y, the parameter a
+// and small literals, reusing a subterm now and then so the IR shares it.
+std::string expression(int depth) {
+    static const char *const leaves[] = { "x", "y", "a", "0", "1", "2", "3", "0.5" };
+
+    if (depth == 0 || below(4) == 0)
+        return leaves[below(8)];
+
+    if (below(8) == 0)
+        return "(-" + expression(depth - 1) + ")";
+
+    static const char operators[] = "+-*/^";
+    char op = operators[below(below(3) ? 4 : 5)];
+    std::string left = expression(depth - 1), right = below(3) == 0 ? left : expression(depth - 1);
+
+    return "(" + left + op + right + ")";
+}
+
+bool same(double a, double b) {
+    return (a != a && b != b) || !memcmp(&a, &b, sizeof(a));
+}
+
+int failures = 0;
+
+void check(bool ok, const std::string &source, int mode, const char *what, double expected, double got) {
+    if (ok)
+        return;
+
+    if (failures++ < 10)
+        printf("%s (mode %d): %s %.17g instead of %.17g\n", source.c_str(), mode, what, got, expected);
+}
+
+const int rows = 6;
+const double xs[rows] = { 1.25, -0.0, 0, -3, 1e10, 0.1 };
+const double ys[rows] = { -3.5, 2, -0.0, 7, 1e-10, 3 };
+
+// Results of f for every row from the stack code, checked against a batch
+// and, when compiled from an IR, the register code.
+std::vector<double> run(const Function &f, const std::string &source, int mode) {
+    VM vm;
+    vm.setFunction(f);
+
+    bool registers = !f.instructions.empty();
+
+    std::vector<double> results(rows);
+
+    if (f.precision == Single) {
+        float args[rows][2], columns[2][rows], out[rows];
+
+        for (int r = 0; r < rows; r++) {
+            args[r][0] = columns[0][r] = static_cast<float>(xs[r]);
+            args[r][1] = columns[1][r] = static_cast<float>(ys[r]);
+        }
+
+        Column<float> batch[2] = { { columns[0], nullptr, 0 }, { columns[1], nullptr, 0 } };
+        vm.runBatchSingle(batch, rows, out, nullptr);
+
+        for (int r = 0; r < rows; r++) {
+            results[r] = vm.runSingle(args[r]);
+
+            if (registers)
+                check(same(results[r], vm.runRegistersSingle(args[r])), source, mode, "register code gives", results[r], vm.runRegistersSingle(args[r]));
+
+            check(same(results[r], out[r]), source, mode, "batch gives", results[r], out[r]);
+        }
+    } else {
+        double out[rows];
+
+        Column<double> batch[2] = { { xs, nullptr, 0 }, { ys, nullptr, 0 } };
+        vm.runBatch(batch, rows, out, nullptr);
+
+        for (int r = 0; r < rows; r++) {
+            double args[2] = { xs[r], ys[r] };
+
+            results[r] = vm.run(args);
+
+            if (registers)
+                check(same(results[r], vm.runRegisters(args)), source, mode, "register code gives", results[r], vm.runRegisters(args));
+
+            check(same(results[r], out[r]), source, mode, "batch gives", results[r], out[r]);
+        }
+    }
+
+    return results;
+}
+
+#ifdef RUN_COMPILED
+// Sets the x87 precision control to that of f while in scope, so the
+// compiled code rounds like the stack code; the test itself runs with the
+// control it had.
+class Rounding {
+public:
+    explicit Rounding(Precision precision) {
+#ifdef _MSC_VER
+        _controlfp_s(&saved, 0, 0);
+        unsigned int ignored;
+        _controlfp_s(&ignored, precision == Single ? _PC_24 : _PC_53, _MCW_PC);
+#else
+        __asm__ volatile ("fnstcw %0" : "=m"(saved));
+        unsigned short word = (saved & ~0x300) | (precision == Single ? 0x000 : 0x200);
+        __asm__ volatile ("fldcw %0" : : "m"(word));
+#endif
+    }
+
+    ~Rounding() {
+#ifdef _MSC_VER
+        unsigned int ignored;
+        _controlfp_s(&ignored, saved, _MCW_PC);
+#else
+        __asm__ volatile ("fldcw %0" : : "m"(saved));
+#endif
+    }
+
+private:
+#ifdef _MSC_VER
+    unsigned int saved;
+#else
+    unsigned short saved;
+#endif
+};
+
+template <class T>
+double call(const x86::Function &code, VM::Signature signature, int r) {
+    T args[2] = { static_cast<T>(xs[r]), static_cast<T>(ys[r]) };
+    Rounding rounding(sizeof(T) == sizeof(float) ? Single : Double);
+
+    if (signature == VM::Scalars)
+        return reinterpret_cast<T (*)(T, T)>(code.getCode())(args[0], args[1]);
+
+    return reinterpret_cast<T (*)(const T *)>(code.getCode())(args);
+}
+#endif
+
+// Compiles f to x87 code; `shared` was compiled from f with a shared pool
+// before its parameter changed. Where the code can run it must give the
+// stack code's results if `exact`.
+void compiled(const Function &f, const x86::Function &shared, const std::vector<double> &expected, bool exact, const std::string &source, int mode) {
+    for (VM::Signature signature : { VM::Array, VM::Scalars }) {
+        x86::Function code = VM().compile(f, signature);
+
+#ifdef RUN_COMPILED
+        for (int r = 0; r < rows; r++) {
+            bool single = f.precision == Single;
+            double got = single ? call<float>(code, signature, r) : call<double>(code, signature, r);
+
+            if (!exact || fabs(xs[r]) >= 1e3 || fabs(ys[r]) >= 1e3)
+                continue;
+
+            check(same(expected[r], got), source, mode, signature == VM::Array ? "compiled code gives" : "compiled code for scalars gives", expected[r], got);
+
+            if (signature == VM::Array) {
+                got = single ? call<float>(shared, signature, r) : call<double>(shared, signature, r);
+                check(same(expected[r], got), source, mode, "compiled code with a shared pool gives", expected[r], got);
+            }
+        }
+#else
+        (void)code;
+        (void)shared;
+        (void)expected;
+        (void)exact;
+        (void)source;
+        (void)mode;
+#endif
+    }
+}
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 20000;
+    generator.seed(argc > 2 ? atoi(argv[2]) : 1);
+
+    Lexer lexer;
+    Parser parser;
+
+    parser.setVariables({ "x", "y" });
+    parser.setParameters({ "a" });
+
+    for (int t = 0; t < count; t++) {
+        int mode = t % 32;
+        bool fastMath = mode & 1, single = mode & 2, folding = !(mode & 4), compensated = mode & 8, reassociation = mode & 16;
+        Precision precision = single ? Single : Double;
+
+        std::string source = expression(1 + below(6));
+
+        try {
+            Optimizer optimizer;
+            Compiler compiler;
+
+            optimizer.setPrecision(precision);
+            optimizer.setFastMath(fastMath);
+            optimizer.setFolding(folding);
+            optimizer.setCompensated(compensated);
+            optimizer.setReassociation(reassociation);
+            compiler.setPrecision(precision);
+
+            std::shared_ptr<Node> tree = optimizer.optimize(parser.parse(lexer.lex(source)));
+
+            IR ir(tree);
+            ir.setPrecision(precision);
+            ir.setFastMath(fastMath);
+            ir.setFolding(folding);
+            ir.optimize();
+
+            Function lowered = compiler.compile(ir), direct = compiler.compile(tree);
+            x86::Function sharedLowered = VM().compile(lowered, VM::Array, true), sharedDirect = VM().compile(direct, VM::Array, true);
+            bool exact = !fastMath && source.find('^') == std::string::npos;
+
+            for (double a : { 0.75, -2.0 }) {
+                lowered.setParameter(0, a);
+                direct.setParameter(0, a);
+
+                std::vector<double> results = run(lowered, source, mode), expected = run(direct, source, mode);
+
+                compiled(lowered, sharedLowered, results, exact, source, mode);
+                compiled(direct, sharedDirect, expected, exact, source, mode);
+
+                for (int r = 0; r < rows && !fastMath; r++) {
+                    check(same(expected[r], results[r]), source, mode, "the IR gives", expected[r], results[r]);
+
+                    double args[2] = { xs[r], ys[r] }, params[1] = { a };
+
+                    if (!single)
+                        check(same(tree->eval(args, params), results[r]), source, mode, "the code gives", tree->eval(args, params), results[r]);
+                }
+            }
+        } catch (const std::exception &e) {
+            check(false, source, mode, e.what(), 0, 0);
+        }
+    }
+
+    printf("%d expressions, %d failures\n", count, failures);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,11 @@
+CONFIG -= qt app_bundle
+CONFIG += console c++11
+
+INCLUDEPATH += .. ../../compiler/compiler
+LIBS += -L../../compiler/compiler/release -lcompiler
+
+HEADERS += \
+    ../jit_calc.h
+
+SOURCES += \
+    lowering.cpp
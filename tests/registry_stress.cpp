@@ -0,0 +1,128 @@
+// Stress test of the expression registry, meant to be run under the
+// sanitizers:
+//
+//   qmake CONFIG+=sanitizer CONFIG+=sanitize_address && make && ./registry_stress
+//   qmake CONFIG+=sanitizer CONFIG+=sanitize_thread && make && ./registry_stress
+//
+// Readers look names up while a writer republishes and removes them, so
+// expressions are retired while readers still hold older ones, and the
+// readers detach and attach again now and then so their slots are reused.
+// A use after free or a data race shows up as a sanitizer report; the
+// checks here catch an expression seen under the wrong name or changing
+// while locked. Exits with 1 on a failed check.
+
+#include "jc.h"
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+const int names = 8;
+const int readers = 6;
+const int publishes = 20000;
+
+std::string nameOf(int i) {
+    return "e" + std::to_string(i);
+}
+
+// Each name only ever holds expressions of this many variables.
+size_t variablesOf(int i) {
+    return i % 3 + 1;
+}
+
+std::atomic<bool> stop(false);
+std::atomic<long> lookups(0), failures(0);
+
+void fail(const char *message) {
+    if (failures++ < 10)
+        fprintf(stderr, "failed: %s\n", message);
+}
+
+void read(jc_registry *registry, int seed) {
+    jc_reader *reader = nullptr;
+
+    for (long round = 0; !stop; round++) {
+        if (!reader && jc_registry_attach(registry, &reader) != JC_OK) {
+            fail("attach");
+            return;
+        }
+
+        int i = static_cast<int>((round + seed) % names);
+        const jc_expr *e = jc_reader_lock(reader, nameOf(i).c_str());
+
+        if (e) {
+            size_t variables = jc_variable_count(e);
+            void *fn = nullptr;
+
+            if (variables != variablesOf(i))
+                fail("expression under the wrong name");
+
+            if (jc_function(e, JC_SIGNATURE_ARRAY, &fn) != JC_OK || !fn)
+                fail("no code");
+
+            std::this_thread::yield();
+
+            if (jc_variable_count(e) != variables)
+                fail("expression changed while locked");
+
+            lookups++;
+        }
+
+        jc_reader_unlock(reader);
+
+        if (round % 1000 == 999) {
+            jc_registry_detach(reader);
+            reader = nullptr;
+        }
+    }
+
+    if (reader)
+        jc_registry_detach(reader);
+}
+}
+
+int main() {
+    static const char *const vars[] = { "x", "y", "z" };
+    static const char *const sources[] = { "x", "x + 1", "x * 2 + 3" };
+
+    jc_registry *registry = jc_registry_create();
+
+    if (!registry) {
+        fprintf(stderr, "failed: create\n");
+        return 1;
+    }
+
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < readers; t++)
+        threads.emplace_back(read, registry, t * 3);
+
+    for (int p = 0; p < publishes; p++) {
+        int i = p % names;
+        jc_expr *e = nullptr;
+
+        if (p % 97 == 0) {
+            if (jc_registry_publish(registry, nameOf(i).c_str(), nullptr) != JC_OK)
+                fail("remove");
+        } else if (jc_compile(sources[p % 3], vars, variablesOf(i), &e) != JC_OK || jc_registry_publish(registry, nameOf(i).c_str(), e) != JC_OK)
+            fail("publish");
+
+        if (p % 500 == 0 && jc_registry_collect(registry) != JC_OK)
+            fail("collect");
+    }
+
+    stop = true;
+
+    for (std::thread &thread : threads)
+        thread.join();
+
+    jc_registry_collect(registry);
+    jc_registry_destroy(registry);
+
+    printf("%ld lookups, %ld failures\n", lookups.load(), failures.load());
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,17 @@
+CONFIG -= qt app_bundle
+CONFIG += console c++11 thread
+
+INCLUDEPATH += .. ../../compiler/compiler
+LIBS += -L../../compiler/compiler/release -lcompiler
+
+unix: DEFINES += _FILE_OFFSET_BITS=64
+
+HEADERS += \
+    ../jit_calc.h \
+    ../jc.h \
+    ../jc_async.h
+
+SOURCES += \
+    registry_stress.cpp \
+    ../jc.cpp \
+    ../jc_registry.cpp